@@ -67,6 +67,12 @@
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 
+/*
+ * And the reverse: the physical address behind a kseg0 address, such
+ * as one handed out by alloc_kpages.
+ */
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -106,13 +112,18 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ *
+ * A shootdown names a page of an address space by its ASID state (see
+ * vmtlb.h), which the target cpu only compares against its own and
+ * never follows, and carries the address space's ASID on the target
+ * as it was when the shootdown was sent.
  */
 
+struct vmtlb_asids;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	struct addrspace *ts_addrspace;
+	struct vmtlb_asids *ts_asids;
+	uint32_t ts_asid;
 	vaddr_t ts_vaddr;
 };
 
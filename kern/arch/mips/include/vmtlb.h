@@ -0,0 +1,118 @@
+#ifndef _MIPS_VMTLB_H_
+#define _MIPS_VMTLB_H_
+
+/*
+ * TLB management for the VM system.
+ *
+ * Each cpu fills its TLB in slot order after a flush, so it knows
+ * which slots are free without reading them back. Once all NUM_TLB
+ * slots have been used, a victim is chosen according to the current
+ * replacement policy. Loads that found a free slot and loads that had
+ * to replace a valid entry are counted in VMSTAT_TLB_FAULT_FREE and
+ * VMSTAT_TLB_FAULT_REPLACE respectively. Entries preloaded ahead of
+ * use by vmtlb_preload don't count as either.
+ *
+ * Address space IDs: each cpu hands out the hardware's ASIDs to
+ * address spaces as they are activated on it, so switching between
+ * address spaces leaves the other ones' entries in the TLB. An ASID
+ * is tagged with the cpu's generation number; when a cpu runs out of
+ * ASIDs it flushes its TLB and starts a new generation, and address
+ * spaces holding an ASID from an older generation get a new one the
+ * next time they are activated. An address space's entries therefore
+ * outlive its running on a cpu, and come back into use if it returns
+ * there within the same generation; so whenever its mappings narrow
+ * (a page goes away, changes frame, or loses write permission), the
+ * old entries are shot down on every cpu it has an ASID on, not just
+ * the current one. ASID 0 is never handed out; it is used by dumbvm
+ * and when ASIDs are turned off, in which case every activation
+ * flushes the TLB as before. Flushes are counted in
+ * VMSTAT_TLB_INVALIDATE.
+ *
+ * Fast refill: a TLB miss on a user address normally goes through
+ * mips_trap to vm_fault. When fast refill is on, vmtlb_activate also
+ * records the address space's page directory for the current cpu,
+ * and the UTLB handler in exception-mips1.S looks the page up there
+ * itself; if it is resident and marked referenced, the handler writes
+ * the PTE into a random TLB slot and returns without calling any C
+ * code. It never writes the PTE, so only misses on pages that aren't
+ * resident, or whose reference bit the clock has cleared, reach
+ * vm_fault. Refills done this way are counted per cpu, not in vmstats.
+ *
+ * Policies:
+ *     TLBPOL_ROUNDROBIN - replace slots in turn (FIFO).
+ *     TLBPOL_RANDOM     - let the processor pick (tlb_random).
+ *
+ * Functions:
+ *     vmtlb_load       - load a translation for VADDR under the current
+ *                        ASID, replacing any existing entry for the
+ *                        same page. Call with interrupts off (at
+ *                        splhigh, or holding a spinlock).
+ *     vmtlb_preload    - like vmtlb_load, but for a page that hasn't
+ *                        faulted yet, and only if it isn't already in
+ *                        the TLB. Returns true if it loaded it. Call
+ *                        with interrupts off, as for vmtlb_load.
+ *     vmtlb_flush      - invalidate the whole TLB of the current cpu.
+ *     vmtlb_invalidate - invalidate the entries, if any, for VADDR in
+ *                        the address space whose ASID state is VA (which
+ *                        need not be the current one) on every cpu that
+ *                        may have one, shooting down those on other cpus,
+ *                        and wait until that is done. Call with
+ *                        interrupts on, before the frame is reused.
+ *     vmtlb_invalidate_nowait - like vmtlb_invalidate, but don't wait
+ *                        for the other cpus, so it may be called holding
+ *                        a spinlock. For when an entry living a little
+ *                        longer does no harm.
+ *     vmtlb_invalidateall - like vmtlb_invalidate, but for all of the
+ *                        entries of the address space whose ASID state
+ *                        is VA.
+ *     vmtlb_shootdown  - carry out a shootdown sent by one of those.
+ *                        Call with interrupts off.
+ *     vmtlb_activate   - switch the current cpu to the address space
+ *                        whose ASID state is VA and whose page
+ *                        directory (see pagetable.h) is PTDIR.
+ *     vmtlb_forget     - make sure no cpu's refill handler uses the
+ *                        page directory PTDIR, which is going away.
+ *     vmtlb_setpolicy  - select the replacement policy by name ("rr"
+ *                        or "random"). Returns EINVAL if unknown.
+ *     vmtlb_policyname - name of the current policy.
+ *     vmtlb_setasids   - turn the use of ASIDs on or off.
+ *     vmtlb_asidson    - whether ASIDs are in use.
+ *     vmtlb_setfastrefill - turn fast refill on or off.
+ *     vmtlb_fastrefillon - whether fast refill is on.
+ *     vmtlb_fastrefills - number of fast refills done on all cpus.
+ *
+ * Machine-independent code gets at the settings by name through
+ * vm_tlbprint and vm_tlbset (see vm.h).
+ */
+
+#include <platform/maxcpus.h>
+
+struct tlbshootdown;
+
+#define TLBPOL_ROUNDROBIN  0
+#define TLBPOL_RANDOM      1
+
+/* Per-address-space ASID state. Zero it to initialize. */
+struct vmtlb_asids {
+	uint32_t va_asid[MAXCPUS];	/* generation | ASID, or 0 */
+};
+
+void        vmtlb_load(vaddr_t vaddr, uint32_t entrylo);
+bool        vmtlb_preload(vaddr_t vaddr, uint32_t entrylo);
+void        vmtlb_flush(void);
+void        vmtlb_invalidate(struct vmtlb_asids *va, vaddr_t vaddr);
+void        vmtlb_invalidate_nowait(struct vmtlb_asids *va, vaddr_t vaddr);
+void        vmtlb_invalidateall(struct vmtlb_asids *va);
+void        vmtlb_shootdown(const struct tlbshootdown *ts);
+void        vmtlb_activate(struct vmtlb_asids *va, uint32_t **ptdir);
+void        vmtlb_forget(uint32_t **ptdir);
+int         vmtlb_setpolicy(const char *name);
+const char *vmtlb_policyname(void);
+void        vmtlb_setasids(bool on);
+bool        vmtlb_asidson(void);
+void        vmtlb_setfastrefill(bool on);
+bool        vmtlb_fastrefillon(void);
+unsigned    vmtlb_fastrefills(void);
+
+
+#endif /* _MIPS_VMTLB_H_ */
@@ -115,6 +115,15 @@ syscall(struct trapframe *tf)
 			  (int)tf->tf_a2,
 			  (int *)(&retval));
 	  break;
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
 	case SYS__exit:
 	  sys__exit((int)tf->tf_a0);
 	  /* sys__exit does not return, execution should not get here */
@@ -129,6 +138,23 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0,
+			 (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  /* fd and offset are on the user stack */
+	  err = sys_mmap((userptr_t)tf->tf_a0,
+			 (size_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int)tf->tf_a3,
+			 (userptr_t)(tf->tf_sp + 16),
+			 (vaddr_t *)&retval);
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0,
+			   (size_t)tf->tf_a1);
+	  break;
 #endif // UW
 
 	    /* Add stuff here */
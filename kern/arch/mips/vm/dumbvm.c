@@ -35,8 +35,11 @@
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <mips/vmtlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <uw-vmstats.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -46,29 +49,22 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
-/*
- * Wrap rma_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
+	vmstats_init();
 }
 
+/*
+ * Physical pages come from the coremap, which falls back on
+ * ram_stealmem until vm_bootstrap has run.
+ */
 static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -86,9 +82,14 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
 
-	(void)addr;
+bool
+vm_idle(void)
+{
+	/* dumbvm zeroes its pages itself */
+	return false;
 }
 
 void
@@ -109,8 +110,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
+	uint32_t elo;
 	struct addrspace *as;
 	int spl;
 
@@ -184,25 +184,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	vmtlb_load(faultaddress, elo);
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -227,13 +219,21 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -244,14 +244,7 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	vmtlb_flush();
 }
 
 void
@@ -351,6 +344,41 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	/* dumbvm has no heap */
+	(void)as;
+	(void)amount;
+	(void)oldbrk;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot, int flags,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	/* dumbvm only has the fixed segments */
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	(void)prot;
+	(void)flags;
+	(void)v;
+	(void)offset;
+	(void)ret;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	(void)as;
+	(void)vaddr;
+	(void)len;
+	return ENOSYS;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -0,0 +1,476 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <mips/vmtlb.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <uw-vmstats.h>
+
+/*
+ * TLB management (see vmtlb.h).
+ */
+
+static const char *const policynames[] = { "rr", "random" };
+#define NPOLICIES (sizeof(policynames) / sizeof(policynames[0]))
+
+static volatile int tlbpolicy = TLBPOL_ROUNDROBIN;
+static volatile bool useasids = true;
+static volatile bool fastrefill = true;
+
+#define ASID_MASK  (NUM_TLBPIDS - 1)
+
+/* Shootdown address meaning every page of the address space */
+#define VMTLB_ALLPAGES  ((vaddr_t)-1)
+
+/*
+ * Per-cpu state, only changed by its own cpu with interrupts off.
+ * Slots below vt_nextfree have been used since the last flush; the
+ * rest are known to be free. Other cpus read vt_cpu, vt_gen and
+ * vt_curas to decide whether to send a shootdown; each is set before
+ * the entries it could tell them about are loaded.
+ */
+struct vmtlb_cpu {
+	struct cpu *vt_cpu;		/* NULL until it first activates */
+	unsigned vt_nextfree;
+	unsigned vt_victim;		/* next round-robin victim */
+	uint32_t vt_gen;		/* ASID generation, low bits clear */
+	unsigned vt_nextasid;		/* next ASID to hand out */
+	struct vmtlb_asids *vt_curas;	/* last address space activated */
+	uint32_t vt_curpid;		/* current ASID, as TLBHI_PID */
+};
+
+static struct vmtlb_cpu vmtlb_cpus[MAXCPUS];
+
+/*
+ * For the refill handler in exception-mips1.S, which indexes these by
+ * the cpu number kept in c0_context: the current page directory (or
+ * NULL to always take the slow path), and a count of refills.
+ */
+uint32_t **vmtlb_ptdirs[MAXCPUS];
+unsigned vmtlb_nrefills[MAXCPUS];
+
+/*
+ * Get the current cpu's state. Interrupts must be off, whether by
+ * splhigh, by holding a spinlock, or by being in the trap handler;
+ * all of them count in t_iplhigh_count, while only splhigh sets
+ * t_curspl.
+ */
+static
+struct vmtlb_cpu *
+vmtlb_cpu(void)
+{
+	KASSERT(curthread->t_iplhigh_count > 0);
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &vmtlb_cpus[curcpu->c_number];
+}
+
+/*
+ * Write a new entry to a free slot if there is one, or else to a
+ * victim. Returns true if it replaced a valid entry.
+ */
+static
+bool
+vmtlb_write(struct vmtlb_cpu *vt, uint32_t entryhi, uint32_t entrylo)
+{
+	if (vt->vt_nextfree < NUM_TLB) {
+		tlb_write(entryhi, entrylo, vt->vt_nextfree++);
+		return false;
+	}
+
+	switch (tlbpolicy) {
+	    case TLBPOL_RANDOM:
+		tlb_random(entryhi, entrylo);
+		break;
+	    default:
+		tlb_write(entryhi, entrylo, vt->vt_victim);
+		vt->vt_victim = (vt->vt_victim + 1) % NUM_TLB;
+		break;
+	}
+	return true;
+}
+
+void
+vmtlb_load(vaddr_t vaddr, uint32_t entrylo)
+{
+	struct vmtlb_cpu *vt;
+	uint32_t entryhi;
+	int slot;
+
+	vt = vmtlb_cpu();
+	entryhi = (vaddr & TLBHI_VPAGE) | vt->vt_curpid;
+
+	/* Never have two entries for the same page. */
+	slot = tlb_probe(entryhi, 0);
+	if (slot >= 0) {
+		tlb_write(entryhi, entrylo, slot);
+		return;
+	}
+
+	if (vmtlb_write(vt, entryhi, entrylo)) {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	}
+}
+
+bool
+vmtlb_preload(vaddr_t vaddr, uint32_t entrylo)
+{
+	struct vmtlb_cpu *vt;
+	uint32_t entryhi;
+
+	vt = vmtlb_cpu();
+	entryhi = (vaddr & TLBHI_VPAGE) | vt->vt_curpid;
+
+	if (tlb_probe(entryhi, 0) >= 0) {
+		return false;
+	}
+	vmtlb_write(vt, entryhi, entrylo);
+	return true;
+}
+
+/*
+ * Flush with interrupts already off.
+ */
+static
+void
+vmtlb_doflush(struct vmtlb_cpu *vt)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(vt->vt_curpid);
+	vt->vt_nextfree = 0;
+	vt->vt_victim = 0;
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+void
+vmtlb_flush(void)
+{
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	vmtlb_doflush(vmtlb_cpu());
+	splx(spl);
+}
+
+/*
+ * Work out the PID under which cpu VT may have entries for the address
+ * space whose ASID state is VA and whose ASID there is ASID. Returns
+ * false if it can't have any.
+ */
+static
+bool
+vmtlb_pidfor(struct vmtlb_cpu *vt, struct vmtlb_asids *va, uint32_t asid,
+	     uint32_t *pid)
+{
+	if (vt->vt_curas == va) {
+		/* The last one activated; under 0 if ASIDs are off. */
+		*pid = vt->vt_curpid;
+		return true;
+	}
+	if (asid == 0 || (asid & ~ASID_MASK) != vt->vt_gen) {
+		/* Never activated there, or flushed since. */
+		return false;
+	}
+	*pid = (asid & ASID_MASK) << TLBHI_PIDSHIFT;
+	return true;
+}
+
+/*
+ * Drop the current cpu's entry, if any, for VADDR under PID. Call with
+ * interrupts off.
+ */
+static
+void
+vmtlb_dropentry(struct vmtlb_cpu *vt, uint32_t pid, vaddr_t vaddr)
+{
+	int slot;
+
+	slot = tlb_probe((vaddr & TLBHI_VPAGE) | pid, 0);
+	if (slot >= 0) {
+		tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+	}
+	/* tlb_probe and tlb_write leave their PID in c0_entryhi */
+	tlb_setpid(vt->vt_curpid);
+}
+
+/*
+ * Drop all of the current cpu's entries under PID. Call with
+ * interrupts off.
+ */
+static
+void
+vmtlb_dropall(struct vmtlb_cpu *vt, uint32_t pid)
+{
+	uint32_t entryhi, entrylo;
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&entryhi, &entrylo, i);
+		if ((entrylo & TLBLO_VALID) && (entryhi & TLBHI_PID) == pid) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	tlb_setpid(vt->vt_curpid);
+}
+
+/*
+ * Drop the current cpu's entry for VADDR under PID, or all of them if
+ * VADDR is VMTLB_ALLPAGES. Call with interrupts off.
+ */
+static
+void
+vmtlb_drop(struct vmtlb_cpu *vt, uint32_t pid, vaddr_t vaddr)
+{
+	if (vaddr == VMTLB_ALLPAGES) {
+		vmtlb_dropall(vt, pid);
+	}
+	else {
+		vmtlb_dropentry(vt, pid, vaddr);
+	}
+}
+
+/*
+ * Drop the entries for VADDR (or VMTLB_ALLPAGES) of the address space
+ * whose ASID state is VA from every cpu that may have them, and if
+ * WAIT is set, wait until the other cpus have done so.
+ */
+static
+void
+vmtlb_dropeverywhere(struct vmtlb_asids *va, vaddr_t vaddr, bool wait)
+{
+	struct tlbshootdown ts;
+	struct vmtlb_cpu *vt;
+	unsigned tickets[MAXCPUS];
+	uint32_t pid, sent;
+	unsigned i;
+	int spl;
+
+	COMPILE_ASSERT(MAXCPUS <= 32);
+
+	ts.ts_asids = va;
+	ts.ts_vaddr = vaddr;
+	sent = 0;
+
+	/* Don't move to another cpu halfway through. */
+	spl = splhigh();
+	for (i=0; i<MAXCPUS; i++) {
+		vt = &vmtlb_cpus[i];
+		if (vt->vt_cpu == NULL ||
+		    !vmtlb_pidfor(vt, va, va->va_asid[i], &pid)) {
+			continue;
+		}
+		if (i == curcpu->c_number) {
+			vmtlb_drop(vt, pid, vaddr);
+			continue;
+		}
+		ts.ts_asid = va->va_asid[i];
+		tickets[i] = ipi_tlbshootdown(vt->vt_cpu, &ts);
+		sent |= (uint32_t)1 << i;
+	}
+	splx(spl);
+
+	if (!wait) {
+		return;
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		if (sent & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown_wait(vmtlb_cpus[i].vt_cpu,
+					      tickets[i]);
+		}
+	}
+}
+
+void
+vmtlb_invalidate(struct vmtlb_asids *va, vaddr_t vaddr)
+{
+	vmtlb_dropeverywhere(va, vaddr & TLBHI_VPAGE, true);
+}
+
+void
+vmtlb_invalidate_nowait(struct vmtlb_asids *va, vaddr_t vaddr)
+{
+	vmtlb_dropeverywhere(va, vaddr & TLBHI_VPAGE, false);
+}
+
+void
+vmtlb_invalidateall(struct vmtlb_asids *va)
+{
+	vmtlb_dropeverywhere(va, VMTLB_ALLPAGES, true);
+}
+
+void
+vmtlb_shootdown(const struct tlbshootdown *ts)
+{
+	struct vmtlb_cpu *vt;
+	uint32_t pid;
+
+	vt = vmtlb_cpu();
+	if (vmtlb_pidfor(vt, ts->ts_asids, ts->ts_asid, &pid)) {
+		vmtlb_drop(vt, pid, ts->ts_vaddr);
+	}
+}
+
+void
+vmtlb_activate(struct vmtlb_asids *va, uint32_t **ptdir)
+{
+	struct vmtlb_cpu *vt;
+	uint32_t *asid;
+	int spl;
+
+	/* The refill handler has these built in. */
+	COMPILE_ASSERT(PT_LEAFSPAN == 1 << 22);
+	COMPILE_ASSERT(PTE_VALID == 0x200 && PTE_REF == 0x4);
+
+	spl = splhigh();
+	vt = vmtlb_cpu();
+	vt->vt_cpu = curcpu->c_self;
+	vt->vt_curas = va;
+	asid = &va->va_asid[curcpu->c_number];
+	vmtlb_ptdirs[curcpu->c_number] = fastrefill ? ptdir : NULL;
+
+	if (!useasids) {
+		*asid = 0;
+		vt->vt_curpid = 0;
+		vmtlb_doflush(vt);
+		splx(spl);
+		return;
+	}
+
+	if (*asid == 0 || (*asid & ~ASID_MASK) != vt->vt_gen) {
+		/* No ASID from this generation; get one. */
+		if (vt->vt_nextasid == 0 || vt->vt_nextasid >= NUM_TLBPIDS) {
+			/* Out of ASIDs; start a new generation. */
+			if (vt->vt_nextasid != 0) {
+				vt->vt_gen += NUM_TLBPIDS;
+			}
+			vt->vt_nextasid = 1;
+			vmtlb_doflush(vt);
+		}
+		*asid = vt->vt_gen | vt->vt_nextasid++;
+	}
+
+	vt->vt_curpid = (*asid & ASID_MASK) << TLBHI_PIDSHIFT;
+	tlb_setpid(vt->vt_curpid);
+
+	splx(spl);
+}
+
+void
+vmtlb_forget(uint32_t **ptdir)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		if (vmtlb_ptdirs[i] == ptdir) {
+			vmtlb_ptdirs[i] = NULL;
+		}
+	}
+}
+
+int
+vmtlb_setpolicy(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<NPOLICIES; i++) {
+		if (!strcmp(name, policynames[i])) {
+			tlbpolicy = i;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+const char *
+vmtlb_policyname(void)
+{
+	return policynames[tlbpolicy];
+}
+
+void
+vmtlb_setasids(bool on)
+{
+	useasids = on;
+}
+
+bool
+vmtlb_asidson(void)
+{
+	return useasids;
+}
+
+void
+vmtlb_setfastrefill(bool on)
+{
+	unsigned i;
+
+	fastrefill = on;
+	if (!on) {
+		/* Other cpus pick up a directory again on activation. */
+		for (i=0; i<MAXCPUS; i++) {
+			vmtlb_ptdirs[i] = NULL;
+		}
+	}
+}
+
+bool
+vmtlb_fastrefillon(void)
+{
+	return fastrefill;
+}
+
+unsigned
+vmtlb_fastrefills(void)
+{
+	unsigned i, total = 0;
+
+	for (i=0; i<MAXCPUS; i++) {
+		total += vmtlb_nrefills[i];
+	}
+	return total;
+}
+
+/*
+ * The settings above, by name, for vm.h.
+ */
+void
+vm_tlbprint(void)
+{
+	kprintf("TLB replacement policy: %s, ASIDs %s\n",
+		vmtlb_policyname(), vmtlb_asidson() ? "on" : "off");
+	kprintf("Fast refill %s, %u refills\n",
+		vmtlb_fastrefillon() ? "on" : "off", vmtlb_fastrefills());
+}
+
+int
+vm_tlbset(const char *setting)
+{
+	if (!strcmp(setting, "fast")) {
+		vmtlb_setfastrefill(true);
+		return 0;
+	}
+	if (!strcmp(setting, "slow")) {
+		vmtlb_setfastrefill(false);
+		return 0;
+	}
+	if (!strcmp(setting, "asid")) {
+		vmtlb_setasids(true);
+		return 0;
+	}
+	if (!strcmp(setting, "noasid")) {
+		vmtlb_setasids(false);
+		return 0;
+	}
+	return vmtlb_setpolicy(setting);
+}
@@ -837,13 +837,17 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Any file can be mapped; the pages go through emufs_read and
+ * emufs_write.
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return EUNIMP;
+	(void)prot;
+	return 0;
 }
 
 //////////////////////////////
@@ -1068,6 +1072,15 @@ emufs_truncate_isdir(struct vnode *v, off_t len)
 	return ENOTDIR;
 }
 
+static
+int
+emufs_mmap_isdir(struct vnode *v, int prot)
+{
+	(void)v;
+	(void)prot;
+	return EISDIR;
+}
+
 //////////////////////////////
 
 /*
@@ -1124,7 +1137,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_dir_gettype,
 	emufs_dir_tryseek,
 	emufs_void_op_isdir,  /* fsync */
-	emufs_void_op_isdir,  /* mmap */
+	emufs_mmap_isdir,     /* mmap */
 	emufs_truncate_isdir,
 	emufs_namefile,
 
@@ -44,11 +44,16 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <objcache.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Storage for struct sfs_vnode */
+static struct objcache sfs_vnode_cache =
+	OBJCACHE_INITIALIZER("sfs_vnode", struct sfs_vnode, NULL, NULL);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +958,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	objcache_put(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1110,14 +1115,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any regular file can be mapped; the pages are
+ * read and written through sfs_read and sfs_write.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return EUNIMP;
+	(void)prot;
+	return 0;
 }
 
 /*
@@ -1685,7 +1692,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = objcache_get(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1706,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		objcache_put(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1743,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		objcache_put(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1754,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		objcache_put(&sfs_vnode_cache, sv);
 		return result;
 	}
 
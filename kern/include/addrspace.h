@@ -36,8 +36,10 @@
 
 
 #include <vm.h>
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
 /* 
@@ -47,6 +49,8 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_DUMBVM
+
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -57,6 +61,74 @@ struct addrspace {
   paddr_t as_stackpbase;
 };
 
+#else
+
+#include <array.h>
+#include <machine/vmtlb.h>
+#include <pagetable.h>
+
+/*
+ * A region is a range of pages defined by as_define_region,
+ * as_define_fileregion or as_define_stack. Pages within it are
+ * allocated and zero-filled when first touched. If the region is
+ * backed by a file (RGB_FILE or RGB_SHARED), the part of each page that
+ * falls within [rg_fvaddr, rg_fvaddr+rg_filesz) is then read in from
+ * rg_vnode. Changes to an RGB_FILE region are private, while those to
+ * an RGB_SHARED region (made by mmap with MAP_SHARED) are written back
+ * to the file when it is unmapped. After a fork, parent and child share
+ * the frames of an RGB_SHARED region outright rather than copy-on-write.
+ *
+ * An address space keeps its regions in an array sorted by address,
+ * so that as_findregion can binary search it on every fault.
+ *
+ * Two regions change size. The heap starts empty just above the
+ * regions loaded from the executable and is moved by as_sbrk. The
+ * stack starts at a single page below USERSTACK and grows down when
+ * a fault lands below it, as long as it stays within the stack limit
+ * (as_setstacklimit) and clear of the heap.
+ */
+struct region {
+	vaddr_t rg_vbase;		/* page-aligned start */
+	size_t rg_npages;
+	int rg_perms;			/* RG_READ | RG_WRITE | RG_EXEC */
+	int rg_backing;			/* RGB_ANON or RGB_FILE */
+
+	struct vnode *rg_vnode;		/* if RGB_FILE */
+	vaddr_t rg_fvaddr;		/* address of first file byte */
+	off_t rg_foffset;		/* its offset in the file */
+	size_t rg_filesz;		/* bytes backed by the file */
+};
+
+#define RG_READ   0x4
+#define RG_WRITE  0x2
+#define RG_EXEC   0x1
+
+/* Backing types */
+#define RGB_ANON    0			/* zero-filled */
+#define RGB_FILE    1			/* partly read from a file */
+#define RGB_SHARED  2			/* RGB_FILE, written back */
+
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region);
+DEFARRAY(region, ASINLINE);
+
+struct addrspace {
+	struct regionarray as_regions;	/* sorted by address */
+	struct pagetable *as_pt;
+	bool as_loading;		/* between prepare and complete_load */
+	struct vmtlb_asids as_asids;	/* TLB address space IDs */
+	struct region *as_heap;		/* NULL until loaded */
+	vaddr_t as_brk;			/* end of the heap, in bytes */
+	struct region *as_stack;	/* NULL until defined */
+	vaddr_t as_falast;		/* last fault, for fault-around */
+	int as_fawindow;		/* pages to preload; < 0 downward */
+};
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Functions in addrspace.c:
  *
@@ -91,6 +163,40 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_fileregion - like as_define_region, but the first
+ *                FILESZ bytes at VADDR are paged in from V at OFFSET.
+ *                (Not in dumbvm.)
+ *
+ *    as_findregion - find the region containing VADDR, or NULL.
+ *                (Not in dumbvm.)
+ *
+ *    as_growstack - grow the stack down to cover VADDR if allowed, and
+ *                return it, or NULL. (Not in dumbvm.)
+ *
+ *    as_setstacklimit - set the most pages a stack may grow to, for all
+ *                address spaces. Returns EINVAL if zero or beyond the
+ *                address space. (Not in dumbvm.)
+ *
+ *    as_getstacklimit - get it. (Not in dumbvm.)
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, and hand
+ *                back its old position in OLDBRK. Pages taken away
+ *                are freed; pages added are allocated when touched.
+ *                Returns EINVAL if the heap would shrink below empty,
+ *                and ENOMEM if it would run into the stack's room.
+ *                (ENOSYS in dumbvm.)
+ *
+ *    as_mmap   - map LEN bytes of file V from OFFSET (which must be
+ *                page-aligned) with protection PROT and FLAGS (see
+ *                <kern/mman.h>), at VADDR if FLAGS has MAP_FIXED and
+ *                otherwise wherever there is room, and hand back the
+ *                address in RET. Pages are read in when touched.
+ *                (ENOSYS in dumbvm.)
+ *
+ *    as_munmap - remove the mapping made by as_mmap at VADDR, which
+ *                must be all of it, writing back changes if it was
+ *                MAP_SHARED. (ENOSYS in dumbvm.)
  */
 
 struct addrspace *as_create(void);
@@ -107,6 +213,40 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+int               as_define_fileregion(struct addrspace *as,
+                                       vaddr_t vaddr, size_t memsz,
+                                       struct vnode *v, off_t offset,
+                                       size_t filesz,
+                                       int readable,
+                                       int writeable,
+                                       int executable);
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+struct region    *as_growstack(struct addrspace *as, vaddr_t vaddr);
+int               as_setstacklimit(unsigned npages);
+unsigned          as_getstacklimit(void);
+#endif
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len,
+                          int prot, int flags, struct vnode *v,
+                          off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+
+
+#if !OPT_DUMBVM
+/*
+ * Functions in vm.c (not in dumbvm):
+ *    vm_getpage - bring in the page of AS at VADDR in region RG, whose
+ *                 PTE *PTE is not resident, as a fault of type
+ *                 FAULTTYPE would. Call with the page table lock held;
+ *                 it is dropped while the page is filled, so look at
+ *                 *PTE again afterwards.
+ */
+
+int vm_getpage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	       int faulttype, pte_t *pte);
+#endif
 
 
 /*
@@ -71,7 +71,7 @@ void getinterval(time_t secs1, uint32_t nsecs,
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
  *
- *  this will be more efficient than clocknap() for longer sleeps
+ * It is clocknap() with the equivalent number of ticks.
  */
 void clocksleep(int seconds);
 
@@ -80,8 +80,45 @@ void clocksleep(int seconds);
  *
  * the timer ticks every LT_GRANULARITY usec (see kern/dev/ltimer.h)
  *
+ * The thread is woken once, when the last tick arrives; see the
+ * timer wheel in clock.c.
  */
 void clocknap(int ticks);
 
+/*
+ * clock_ticks() returns the number of timer ticks since boot. It
+ * wraps; clock_due() says whether tick DEADLINE has been reached,
+ * allowing for that.
+ */
+unsigned clock_ticks(void);
+bool clock_due(unsigned deadline);
+
+/*
+ * Timeouts call a function from the timer interrupt once a given tick
+ * is reached. The caller provides the storage, which must stay put
+ * until the timeout has fired or timeout_stop has returned.
+ *
+ * timeout_start arms TO to call FUNC(DATA) at tick DEADLINE (or the
+ * next tick, if that has already passed). FUNC runs in interrupt
+ * context and may not sleep.
+ *
+ * timeout_stop disarms TO. It returns true if it did so before the
+ * callback ran, and false if the callback has already run, waiting
+ * for it to finish if it is running now. Don't call it holding
+ * anything the callback needs.
+ */
+struct timeout {
+	struct timeout *to_next;	/* in its timer wheel slot */
+	struct timeout *to_prev;
+	unsigned to_deadline;
+	void (*to_func)(void *);
+	void *to_data;
+	bool to_pending;		/* armed and not yet fired */
+};
+
+void timeout_start(struct timeout *to, unsigned deadline,
+		   void (*func)(void *), void *data);
+bool timeout_stop(struct timeout *to);
+
 
 #endif /* _CLOCK_H_ */
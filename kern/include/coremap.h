@@ -0,0 +1,69 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Coremap - bookkeeping for the physical pages the VM system manages.
+ *
+ * Free memory is kept as runs of contiguous page frames. Each free run
+ * carries its length at both ends, so a run being freed can be merged
+ * with free neighbours on either side in constant time. Free runs are
+ * kept on lists segregated by size (one list per power of two), so a
+ * single page or a contiguous run can be found without scanning the
+ * whole map.
+ *
+ * Until coremap_bootstrap is called, pages are stolen from ram.c and
+ * can never be freed; coremap_free silently ignores them.
+ *
+ * Functions:
+ *     coremap_bootstrap - take over the memory reported by ram_getsize.
+ *     coremap_alloc     - allocate NPAGES physically contiguous pages.
+ *                         Returns 0 if no such run is available.
+ *     coremap_allocz    - allocate a page that is already zeroed, from
+ *                         the pool kept by coremap_zerofill. Returns 0
+ *                         if the pool is empty.
+ *     coremap_zerofill  - if the pool is not full, zero a free page and
+ *                         add it. Returns false if there was nothing to
+ *                         do. For idle cpus.
+ *     coremap_free      - drop a reference to a run returned by
+ *                         coremap_alloc, freeing it if that was the
+ *                         last one.
+ *     coremap_ref       - add a reference to an allocated run, so it
+ *                         can be shared.
+ *     coremap_refcount  - number of references to an allocated run.
+ *     coremap_setowner  - record that the single page at PADDR holds
+ *                         page VADDR of user address space AS, making
+ *                         it a candidate for eviction. An AS of NULL
+ *                         makes it not one (e.g. while it is shared).
+ *     coremap_setslot   - record the swap slot holding a copy of the
+ *                         page, or COREMAP_NOSLOT.
+ *     coremap_getslot   - the slot recorded by coremap_setslot.
+ *     coremap_clock     - advance the clock hand to the next candidate
+ *                         for eviction, returning its frame and owner.
+ *                         Returns 0 if there are no candidates.
+ *     coremap_getstats  - report the number of managed and free pages.
+ *     coremap_printstats - print a fragmentation report: free runs by
+ *                         size, and the largest run.
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+#define COREMAP_NOSLOT  0xffffffff
+
+void    coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+paddr_t coremap_allocz(void);
+bool    coremap_zerofill(void);
+void    coremap_free(paddr_t paddr);
+void    coremap_ref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+void    coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void    coremap_setslot(paddr_t paddr, unsigned slot);
+unsigned coremap_getslot(paddr_t paddr);
+paddr_t coremap_clock(struct addrspace **as, vaddr_t *vaddr);
+void    coremap_getstats(unsigned *total, unsigned *nfree);
+void    coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
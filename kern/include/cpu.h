@@ -60,6 +60,7 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct kmalloc_cpu *c_kmalloc;	/* kmalloc magazines (kmalloc.c) */
 
 	/*
 	 * Accessed by other cpus.
@@ -69,6 +70,13 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Length of c_runqueue, for other cpus looking for work to
+	 * steal. Written under the runqueue lock but read without it,
+	 * so it is only a hint.
+	 */
+	volatile unsigned c_load;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -82,10 +90,16 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Shootdowns are numbered as they are queued; c_shootdowns_done
+	 * is the number of the last one carried out, so that the sender
+	 * can wait for it.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdowns_sent;
+	volatile unsigned c_shootdowns_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +123,11 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return the number of CPUs that have been created.
+ */
+unsigned cpu_count(void);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +171,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns a ticket to pass to ipi_tlbshootdown_wait, which waits
+ * until the target CPU has done the shootdown. Don't wait with
+ * interrupts off; the target may be waiting on us.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,7 +187,9 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
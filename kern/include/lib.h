@@ -126,6 +126,13 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_printlockstats(void);
+
+/*
+ * Per-cpu kmalloc state, set up by cpu_create. May return NULL, in
+ * which case that cpu always uses the shared allocator.
+ */
+struct kmalloc_cpu *kmalloc_cpu_create(void);
 
 /*
  * C string functions. 
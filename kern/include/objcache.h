@@ -0,0 +1,71 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * An object cache hands out objects of one fixed size, carved from
+ * whole pages ("slabs") with no size-class rounding. Objects are
+ * returned to the cache in their constructed state: the constructor
+ * runs only the first time an object is handed out, and the
+ * destructor only when its slab is given back to the VM system. So
+ * whatever the constructor sets up (locks, lists, buffers) survives
+ * from one use to the next, and users only need to initialize the
+ * fields that change per use.
+ *
+ * Caches are meant to be static; use OBJCACHE_INITIALIZER to declare
+ * one. An object must fit comfortably in a page.
+ *
+ * Functions:
+ *     objcache_get        - get an object, constructing it if needed.
+ *                           Returns NULL if out of memory or if the
+ *                           constructor fails.
+ *     objcache_put        - return an object, which must be back in
+ *                           its constructed state.
+ *     objcache_discard    - return an object that is not in its
+ *                           constructed state. It is constructed
+ *                           again before it is next handed out.
+ *     objcache_printstats - print usage and hit rates for all caches.
+ *
+ * The constructor returns 0 or an error code, and may sleep; so may
+ * the destructor. Either may be NULL.
+ */
+
+#include <spinlock.h>
+
+struct slab;
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;			/* object size */
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;
+	struct slab *oc_partial;	/* slabs with objects in use and free */
+	struct slab *oc_empty;		/* slabs with no objects in use */
+	unsigned oc_nempty;		/* length of oc_empty */
+	unsigned oc_nslabs;		/* total slabs */
+	unsigned oc_inuse;		/* objects handed out */
+
+	/* statistics */
+	unsigned oc_gets;		/* calls to objcache_get */
+	unsigned oc_hits;		/* ...served an already-built object */
+	unsigned oc_ctors;		/* constructor calls */
+	unsigned oc_dtors;		/* destructor calls */
+
+	struct objcache *oc_next;	/* list of all caches */
+	bool oc_listed;			/* on that list yet? */
+};
+
+#define OBJCACHE_INITIALIZER(name, type, ctor, dtor) \
+	{ name, sizeof(type), ctor, dtor, SPINLOCK_INITIALIZER, \
+	  NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, false }
+
+void *objcache_get(struct objcache *oc);
+void  objcache_put(struct objcache *oc, void *obj);
+void  objcache_discard(struct objcache *oc, void *obj);
+void  objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
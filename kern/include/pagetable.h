@@ -0,0 +1,100 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Page tables.
+ *
+ * A two-level table mapping the user virtual pages of one address
+ * space to page table entries (PTEs). The directory is indexed by the
+ * top bits of the address, and each leaf, which is one page, by the
+ * next ten. Leaves are allocated the first time an address they cover
+ * is looked up with CREATE set, so a sparse address space costs
+ * little.
+ *
+ * A PTE has the layout of a MIPS TLBLO word, so the entry for a
+ * resident page can be loaded into the TLB as is: the physical frame,
+ * PTE_VALID if the page is resident, and PTE_WRITE if it may be
+ * written. The low eight bits, which the TLB ignores, are for
+ * software. A PTE of 0 means the page has never been touched, or
+ * that it was evicted without ever being modified, so that it can be
+ * made again the same way.
+ *
+ * A page that has been evicted to swap has PTE_SWAPPED set and its
+ * swap slot where the frame would be (see PTE_SLOT). PTE_DIRTY is set
+ * on a resident page once it has been written, and then PTE_WRITE
+ * too; until then it is mapped read-only even in a writable region so
+ * that the first write can be noticed. PTE_REF is set whenever
+ * vm_fault loads the page into the TLB. The refill handler in
+ * exception-mips1.S, which also knows the table's layout, only reads
+ * PTEs: it loads pages that have both PTE_VALID and PTE_REF, and
+ * leaves the rest to vm_fault, so that a page the clock has cleared
+ * PTE_REF on is noticed the next time it is used.
+ *
+ * Locking: all PTEs are read and changed holding one spinlock, taken
+ * with pt_lock, so a fault on a resident page never sleeps. Anything
+ * that needs to sleep on a page (to read it in, write it out, or copy
+ * it) sets PTE_BUSY on its PTE first and drops the lock; others who
+ * find the page busy leave it alone, or wait with pt_waitbusy and
+ * look again. A page being evicted also loses PTE_VALID while it is
+ * busy, so that it can't be used. Leaves are only made by the address
+ * space's own thread and stay until pt_destroy, so a PTE pointer
+ * stays good without the lock.
+ *
+ * Functions:
+ *     pt_bootstrap - set up the lock.
+ *     pt_create  - create an empty page table. Returns NULL if out of
+ *                  memory.
+ *     pt_destroy - free the table itself. The caller must already
+ *                  have dealt with whatever the PTEs refer to.
+ *     pt_lookup  - find the PTE for VADDR. If there is no leaf for it,
+ *                  returns NULL, or if CREATE is set, makes one
+ *                  (returning NULL if out of memory). With CREATE set,
+ *                  call without the lock held.
+ *     pt_foreach - call FUNC on every nonzero PTE, in address order.
+ *                  Stops and returns the first nonzero result.
+ *     pt_lock    - take the page table lock.
+ *     pt_unlock  - release it.
+ *     pt_waitbusy - release it, sleep until some busy page stops being
+ *                  busy, and take it again.
+ *     pt_wakebusy - wake those waiting, after clearing PTE_BUSY.
+ */
+
+#include <vm.h>
+#include <machine/tlb.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME     TLBLO_PPAGE	/* physical frame, if PTE_VALID */
+#define PTE_VALID     TLBLO_VALID	/* page is resident */
+#define PTE_WRITE     TLBLO_DIRTY	/* page may be written */
+#define PTE_SWAPPED   0x00000001	/* page is in swap */
+#define PTE_DIRTY     0x00000002	/* page modified since paged in */
+#define PTE_REF       0x00000004	/* loaded into the TLB (for the clock) */
+#define PTE_BUSY      0x00000008	/* being worked on without the lock */
+
+#define PTE_SLOT(pte)        (((pte) & PTE_FRAME) / PAGE_SIZE)
+#define PTE_MKSWAPPED(slot)  ((pte_t)(slot) * PAGE_SIZE | PTE_SWAPPED)
+
+#define PT_LEAFSIZE   (PAGE_SIZE / sizeof(pte_t))
+#define PT_LEAFSPAN   (PT_LEAFSIZE * PAGE_SIZE)	/* bytes mapped per leaf */
+#define PT_DIRSIZE    (USERSPACETOP / PT_LEAFSPAN)
+
+struct pagetable {
+	pte_t *pt_dir[PT_DIRSIZE];	/* leaves, or NULL */
+};
+
+void              pt_bootstrap(void);
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int               pt_foreach(struct pagetable *pt,
+                             int (*func)(vaddr_t vaddr, pte_t *pte,
+                                         void *data),
+                             void *data);
+void              pt_lock(void);
+void              pt_unlock(void);
+void              pt_waitbusy(void);
+void              pt_wakebusy(void);
+
+
+#endif /* _PAGETABLE_H_ */
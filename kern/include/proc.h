@@ -36,6 +36,7 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <limits.h>
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 
@@ -66,6 +67,9 @@ struct proc {
      system calls, since each process will need to keep track of all files
      it has opened, not just the console. */
   struct vnode *console;                /* a vnode for the console device */
+  /* files opened with open(), by descriptor; 0-2 are the console */
+  struct vnode *p_files[OPEN_MAX];
+  int p_fileflags[OPEN_MAX];            /* O_ACCMODE part of open flags */
 #endif
 
 	/* add more material here as needed */
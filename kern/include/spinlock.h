@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-spinlockstats.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -53,16 +54,36 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * It is a ticket lock: each acquirer takes the next number from
+ * lk_next and waits until lk_serving reaches it, so CPUs get the lock
+ * in the order they asked for it.
+ *
+ * With the spinlockstats option, each lock also counts how often it
+ * was taken, how often that meant waiting, and how long the waits
+ * were. The counters are only updated by the holder.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_next;	/* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving;	/* Ticket that holds the lock. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_SPINLOCKSTATS
+	unsigned lk_acquires;		/* Times acquired. */
+	unsigned lk_contended;		/* Times that had to wait. */
+	unsigned lk_spins;		/* Total spin iterations waiting. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_SPINLOCKSTATS
+#define SPINLOCK_INITIALIZER	\
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, 0 }
+#else
+#define SPINLOCK_INITIALIZER	\
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
 
 /*
  * Spinlock functions.
@@ -74,6 +95,8 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the lock's counters under NAME, if it has them.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +107,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(struct spinlock *lk, const char *name);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -0,0 +1,106 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swapping.
+ *
+ * When physical memory runs out, pages of user address spaces are
+ * evicted to a swap area on a raw disk, SWAP_DEVICE. Victims are
+ * chosen by the clock (second-chance) algorithm over the coremap: the
+ * hand passes over the pages that may be evicted in turn, and one that
+ * has been referenced since it last passed gets another chance. The
+ * MIPS TLB keeps no reference bits, so a page counts as referenced
+ * when vm_fault loads it into the TLB, which sets PTE_REF; when the
+ * hand clears that it also drops the page's TLB entries, so the next
+ * use faults and, since the refill handler passes over unreferenced
+ * pages, reaches vm_fault to set it again.
+ *
+ * Only dirty pages are written out. A clean page that already has a
+ * copy in swap goes back to referring to it, and a clean page that has
+ * none is dropped and made again (zero-filled, or read from its
+ * executable) the next time it is touched. Pages shared copy-on-write
+ * are never evicted. Without a swap disk, clean pages can still be.
+ *
+ * Pages are evicted in clusters. The dirty pages of a cluster are
+ * given a run of free slots, in address order, and written with one
+ * request to the device. A swap-in then reads ahead the following
+ * pages of the address space if they are in the following slots,
+ * again in one request, as long as memory is not short.
+ *
+ * Evicting inside a fault means the fault waits for a disk write, so
+ * a pageout thread tries to keep a reserve of free pages: when an
+ * allocation leaves fewer than the low watermark free, it is woken
+ * and evicts pages until the high watermark is reached. Eviction in
+ * the fault path is only the fallback when the reserve runs out.
+ *
+ * Page tables and the coremap's record of which user page each frame
+ * holds are protected by the page table lock (see pagetable.h), and
+ * swap slots by a spinlock of their own. Choosing victims is also
+ * serialized by a sleeping lock, the VM lock, taken with swap_lock. It
+ * is dropped while victims are written out: they are marked busy,
+ * which keeps their owners and everyone else off them meanwhile.
+ * Swap-in reads likewise happen with the faulting page (and any read
+ * ahead) busy and no lock held. A thread may take the VM lock again
+ * while holding it, since allocating memory can mean evicting.
+ *
+ * Lock order: the VM lock is never held across file I/O, or while
+ * taking any other sleeping lock, and nobody sleeps holding the page
+ * table lock. So a thread holding a filesystem lock (or any other)
+ * can fault, or allocate memory, without risking deadlock: file
+ * pages are read in, and shared mappings written back at munmap and
+ * exit, with the page busy and no VM lock held.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device and start the pageout
+ *                      thread. If there is no device, only clean pages
+ *                      can be evicted.
+ *     swap_lock      - take the VM lock.
+ *     swap_unlock    - release it.
+ *     swap_getpages  - allocate NPAGES contiguous pages like
+ *                      coremap_alloc, evicting pages to make room if
+ *                      necessary and if the caller may sleep (is not
+ *                      in an interrupt, at splhigh, or holding a
+ *                      spinlock). Returns 0 if out of memory.
+ *     swap_pagein    - bring back the page of AS at VADDR from swap
+ *                      slot SLOT, handing back its new PTE in *NEWPTE,
+ *                      and maybe some that follow it. Call with its
+ *                      PTE busy and without the page table lock.
+ *                      Counted as one page fault from disk.
+ *     swap_read      - read swap slot SLOT into the frame at PADDR.
+ *     swap_freeframe - drop a reference to a user page's frame, and
+ *                      when it is freed, to its copy in swap.
+ *     swap_free      - free swap slot SLOT.
+ *     swap_setwater  - set the pageout watermarks, in pages. Returns
+ *                      EINVAL unless LOW < HIGH <= the number of pages.
+ *     swap_getwater  - get them.
+ *     swap_printstats - print swap usage and pageout activity.
+ *
+ * swap_freeframe must be called with the page table lock held.
+ */
+
+#include <vm.h>
+#include <pagetable.h>
+
+struct addrspace;
+
+#define SWAP_DEVICE  "lhd0raw:"
+
+/* Default pageout watermarks, in pages */
+#define SWAP_LOWATER   8
+#define SWAP_HIWATER   24
+
+void    swap_bootstrap(void);
+void    swap_lock(void);
+void    swap_unlock(void);
+paddr_t swap_getpages(unsigned long npages);
+int     swap_pagein(struct addrspace *as, vaddr_t vaddr, unsigned slot,
+                    pte_t *newpte);
+int     swap_read(unsigned slot, paddr_t paddr);
+void    swap_freeframe(paddr_t paddr);
+void    swap_free(unsigned slot);
+int     swap_setwater(unsigned low, unsigned high);
+void    swap_getwater(unsigned *low, unsigned *high);
+void    swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
@@ -62,6 +62,12 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_timeout is P that gives up after TICKS timer ticks (see clocknap),
+ * returning ETIMEDOUT. It returns 0 if it decremented the count.
+ */
+int P_timeout(struct semaphore *, int ticks);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -74,8 +80,9 @@ void V(struct semaphore *);
  */
 struct lock {
         char *lk_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *lk_wchan;
+	struct spinlock lk_lock;
+	struct thread *volatile lk_holder;
 };
 
 struct lock *lock_create(const char *name);
@@ -89,12 +96,18 @@ void lock_acquire(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
+ *    lock_tryacquire - Get the lock if nobody holds it, without waiting.
+ *                   Returns true if it got it.
+ *    lock_acquire_timeout - Get the lock, but give up after TICKS timer
+ *                   ticks. Returns 0 or ETIMEDOUT.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
+bool lock_tryacquire(struct lock *);
+int lock_acquire_timeout(struct lock *, int ticks);
 
 
 /*
@@ -113,8 +126,7 @@ void lock_destroy(struct lock *);
 
 struct cv {
         char *cv_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *cv_wchan;
 };
 
 struct cv *cv_create(const char *name);
@@ -126,6 +138,10 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_wait_timeout - cv_wait, but stop waiting after TICKS timer
+ *                   ticks. The lock is reacquired either way (that
+ *                   wait is not bounded). Returns 0 if woken, or
+ *                   ETIMEDOUT.
  *
  * For all three operations, the current thread must hold the lock passed 
  * in. Note that under normal circumstances the same lock should be used
@@ -136,6 +152,7 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_wait_timeout(struct cv *cv, struct lock *lock, int ticks);
 
 
 #endif /* _SYNCH_H_ */
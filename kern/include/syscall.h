@@ -60,9 +60,15 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_close(int fdesc);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+	     userptr_t stackargs, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
 
 #endif // UW
 
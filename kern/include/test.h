@@ -57,9 +57,11 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int timedtest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -75,10 +77,12 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int mmaptest(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -84,6 +84,17 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduler fields (see schedule()). Protected by the run
+	 * queue lock of t_cpu, or owned by the thread while it runs.
+	 */
+	unsigned t_priority;		/* MLFQ level; 0 is the highest */
+	unsigned t_ticks;		/* hardclocks used at this level */
+	unsigned t_waited;		/* schedule() passes spent ready */
+
+	/* Timer tick to wake at, while in clocknap (see wchan_wakedue) */
+	unsigned t_wakeup;
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -163,10 +174,25 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for a hardclock. Returns true if it
+ * should yield: it has used up its quantum, or a thread of higher
+ * priority is waiting. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
+/*
+ * Select the scheduling policy by name: "mlfq" (the default) or "rr"
+ * (plain round-robin, one hardclock per turn). Returns EINVAL if
+ * unknown.
+ */
+int thread_setsched(const char *name);
+const char *thread_schedname(void);
+
+/*
+ * Print the contention counters of each cpu's run queue lock (see
+ * spinlock.h).
  */
-void thread_consider_migration(void);
+void thread_printlockstats(void);
 
 
 #endif /* _THREAD_H_ */
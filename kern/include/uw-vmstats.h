@@ -36,7 +36,10 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_ZERO_POOL_HIT         (10)
+#define VMSTAT_ZERO_POOL_MISS        (11)
+#define VMSTAT_FAULT_AROUND          (12)
+#define VMSTAT_COUNT                 (13)
 
 /* ----------------------------------------------------------------------- */
 
@@ -55,9 +55,19 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Housekeeping for an idle cpu; returns true if there was any to do */
+bool vm_idle(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * TLB management settings, for the kernel menu: print them, or change
+ * one by name. Returns EINVAL for a name the machine doesn't know.
+ */
+void vm_tlbprint(void);
+int vm_tlbset(const char *setting);
+
 
 #endif /* _VM_H_ */
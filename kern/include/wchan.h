@@ -71,6 +71,14 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but also wake up at timer tick DEADLINE (see
+ * clock.h) if nobody has woken the thread by then. The thread is then
+ * taken off the channel, so a later wakeup won't go to it. Returns
+ * true if it timed out, false if it was woken.
+ */
+bool wchan_sleep_until(struct wchan *wc, unsigned deadline);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
@@ -81,5 +89,12 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up only the threads whose t_wakeup tick is at or before NOW.
+ * This is for the timer wheel in clock.c. The queue should not
+ * already be locked.
+ */
+void wchan_wakedue(struct wchan *wc, unsigned now);
+
 
 #endif /* _WCHAN_H_ */
@@ -49,6 +49,7 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <objcache.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -69,6 +70,33 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 
+/*
+ * Cached proc structures keep their lock and thread array (including
+ * whatever storage the array has grown).
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct objcache proc_cache =
+	OBJCACHE_INITIALIZER("proc", struct proc, proc_ctor, proc_dtor);
 
 
 /*
@@ -79,19 +107,20 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+#ifdef UW
+	int i;
+#endif
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_get(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_put(&proc_cache, proc);
 		return NULL;
 	}
-
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -101,6 +130,9 @@ proc_create(const char *name)
 
 #ifdef UW
 	proc->console = NULL;
+	for (i=0; i<OPEN_MAX; i++) {
+		proc->p_files[i] = NULL;
+	}
 #endif // UW
 
 	return proc;
@@ -112,6 +144,10 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+#ifdef UW
+	int i;
+#endif
+
 	/*
          * note: some parts of the process structure, such as the address space,
          *  are destroyed in sys_exit, before we get here
@@ -161,13 +197,18 @@ proc_destroy(struct proc *proc)
 	if (proc->console) {
 	  vfs_close(proc->console);
 	}
+	for (i=0; i<OPEN_MAX; i++) {
+		if (proc->p_files[i] != NULL) {
+			vfs_close(proc->p_files[i]);
+		}
+	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(!spinlock_do_i_hold(&proc->p_lock));
 
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_put(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
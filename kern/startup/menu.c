@@ -42,9 +42,16 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <uw-vmstats.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <addrspace.h>
+#include <swap.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -409,6 +416,118 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstats_print();
+
+	return 0;
+}
+
+/*
+ * Command to select the TLB replacement policy, whether to use
+ * address space IDs, and whether to refill the TLB in the fast path.
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_tlbprint();
+		return 0;
+	}
+	if (nargs != 2 || vm_tlbset(args[1])) {
+		kprintf("Usage: tlb [rr|random|asid|noasid|fast|slow]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Command for printing spinlock contention counters.
+ */
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printlockstats();
+	kheap_printlockstats();
+	return 0;
+}
+
+/*
+ * Command to select the scheduling policy.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	if (nargs == 2) {
+		if (thread_setsched(args[1])) {
+			kprintf("Usage: sched [mlfq|rr]\n");
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sched [mlfq|rr]\n");
+		return EINVAL;
+	}
+	kprintf("Scheduling policy: %s\n", thread_schedname());
+	return 0;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Command for showing swap usage and setting the pageout watermarks.
+ */
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	if (nargs == 3) {
+		if (swap_setwater(atoi(args[1]), atoi(args[2]))) {
+			kprintf("pageout: need low < high <= pages of memory\n");
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: po [low high]\n");
+		return EINVAL;
+	}
+	swap_printstats();
+	return 0;
+}
+
+/*
+ * Command for showing and setting the limit on user stack growth.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	if (nargs == 2) {
+		if (as_setstacklimit(atoi(args[1]))) {
+			kprintf("stack: limit must be 1 to %u pages\n",
+				USERSTACK / PAGE_SIZE);
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: stk [pages]\n");
+		return EINVAL;
+	}
+	kprintf("User stack limit: %u pages\n", as_getstacklimit());
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -470,15 +589,18 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc scaling benchmark     ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Scheduler latency test        ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Timed wait test               ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -488,6 +610,9 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if !OPT_DUMBVM
+	"[fs6] mmap test             (4)     ",
+#endif
 	NULL
 };
 
@@ -519,6 +644,14 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[vs] VM stats                       ",
+	"[tlb] TLB policy and ASIDs          ",
+	"[sched] Scheduling policy           ",
+	"[sl] Spinlock contention stats      ",
+#if !OPT_DUMBVM
+	"[po] Swap and pageout watermarks    ",
+	"[stk] User stack limit              ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -576,23 +709,34 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vs",		cmd_vmstats },
+	{ "tlb",	cmd_tlbpolicy },
+	{ "sched",	cmd_sched },
+	{ "sl",		cmd_lockstats },
+#if !OPT_DUMBVM
+	{ "po",		cmd_pageout },
+	{ "stk",	cmd_stacklimit },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	timedtest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -604,6 +748,9 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+#if !OPT_DUMBVM
+	{ "fs6",	mmaptest },
+#endif
 
 	{ NULL, NULL }
 };
@@ -1,6 +1,9 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <kern/unistd.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <syscall.h>
@@ -8,6 +11,8 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +63,145 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+/* handler for open() system call                   */
+/*
+ * n.b. the file table only holds vnodes, with no seek position, so
+ * for now opened files are only good for mmap() and close().
+ */
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  struct vnode *v;
+  char *path;
+  int fdesc;
+  int res;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr(upath, path, PATH_MAX, NULL);
+  if (res) {
+    kfree(path);
+    return res;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: open(%s,%d,%d)\n",path,flags,mode);
+
+  /* 0-2 are always the console */
+  for (fdesc = STDERR_FILENO + 1; fdesc < OPEN_MAX; fdesc++) {
+    if (curproc->p_files[fdesc] == NULL) {
+      break;
+    }
+  }
+  if (fdesc == OPEN_MAX) {
+    kfree(path);
+    return EMFILE;
+  }
+
+  /* vfs_open destroys the string it's passed */
+  res = vfs_open(path, flags, mode, &v);
+  kfree(path);
+  if (res) {
+    return res;
+  }
+  curproc->p_files[fdesc] = v;
+  curproc->p_fileflags[fdesc] = flags & O_ACCMODE;
+  *retval = fdesc;
+  return 0;
+}
+
+/* handler for close() system call                  */
+
+int
+sys_close(int fdesc)
+{
+  DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+
+  if (fdesc <= STDERR_FILENO || fdesc >= OPEN_MAX ||
+      curproc->p_files[fdesc] == NULL) {
+    return EBADF;
+  }
+  vfs_close(curproc->p_files[fdesc]);
+  curproc->p_files[fdesc] = NULL;
+  return 0;
+}
+
+/*
+ * Find the vnode open as file descriptor FDESC, and the O_ACCMODE
+ * part of the flags it was opened with. Standard input, output and
+ * error are the console.
+ */
+
+static int
+file_getvnode(int fdesc, struct vnode **ret, int *accmode)
+{
+  if (fdesc == STDIN_FILENO || fdesc == STDOUT_FILENO ||
+      fdesc == STDERR_FILENO) {
+    KASSERT(curproc->console != NULL);
+    *ret = curproc->console;
+    *accmode = O_RDWR;
+    return 0;
+  }
+  if (fdesc < 0 || fdesc >= OPEN_MAX || curproc->p_files[fdesc] == NULL) {
+    return EBADF;
+  }
+  *ret = curproc->p_files[fdesc];
+  *accmode = curproc->p_fileflags[fdesc];
+  return 0;
+}
+
+/* handler for mmap() system call                   */
+/*
+ * The fifth and sixth arguments, the file descriptor and the (64-bit,
+ * so aligned) offset, don't fit in registers and are fetched from the
+ * user stack at STACKARGS.
+ */
+
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+	 userptr_t stackargs, vaddr_t *retval)
+{
+  struct vnode *v;
+  int fdesc, accmode;
+  off_t offset;
+  int res;
+
+  res = copyin(stackargs, &fdesc, sizeof(fdesc));
+  if (res) {
+    return res;
+  }
+  res = copyin(stackargs + 8, &offset, sizeof(offset));
+  if (res) {
+    return res;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%x,%d,%d,%d,%d)\n",
+	(unsigned int)addr,len,prot,flags,fdesc);
+
+  res = file_getvnode(fdesc, &v, &accmode);
+  if (res) {
+    return res;
+  }
+  /* The file must be readable, and writable to write through to it. */
+  if (accmode == O_WRONLY ||
+      ((flags & MAP_SHARED) && (prot & PROT_WRITE) && accmode != O_RDWR)) {
+    return EACCES;
+  }
+  KASSERT(curproc->p_addrspace != NULL);
+  return as_mmap(curproc->p_addrspace, (vaddr_t)addr, len, prot, flags,
+		 v, offset, retval);
+}
+
+/* handler for munmap() system call                 */
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  DEBUG(DB_SYSCALL,"Syscall: munmap(%x,%d)\n",(unsigned int)addr,len);
+
+  KASSERT(curproc->p_addrspace != NULL);
+  return as_munmap(curproc->p_addrspace, (vaddr_t)addr, len);
+}
@@ -37,6 +37,10 @@
  *    - then it loads each chunk of the program;
  *    - finally, as_complete_load.
  *
+ * Without dumbvm, it uses as_define_fileregion instead, and loads
+ * nothing: the VM system reads each page of the program from the
+ * executable the first time it is touched.
+ *
  * This gives the VM code enough flexibility to deal with even grossly
  * mis-linked executables if that proves desirable. Under normal
  * circumstances, as_prepare_load and as_complete_load probably don't
@@ -59,6 +63,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
+
+#if OPT_DUMBVM
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -144,6 +151,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -243,11 +251,20 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
+#else
+		result = as_define_fileregion(as,
+					      ph.p_vaddr, ph.p_memsz,
+					      v, ph.p_offset, ph.p_filesz,
+					      ph.p_flags & PF_R,
+					      ph.p_flags & PF_W,
+					      ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -258,6 +275,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
+
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +314,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif /* OPT_DUMBVM */
 
 	result = as_complete_load(as);
 	if (result) {
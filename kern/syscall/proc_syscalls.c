@@ -92,3 +92,17 @@ sys_waitpid(pid_t pid,
   return(0);
 }
 
+
+/* handler for sbrk() system call: heap pages are allocated when touched */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as;
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return(EINVAL);
+  }
+  return(as_sbrk(as, amount, retval));
+}
@@ -32,6 +32,8 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -137,3 +139,97 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Measure kmalloc/kfree throughput. Each thread cycles a small working
+ * set of blocks of assorted sizes; this is repeated with 1, 2, ...
+ * threads up to one per cpu, and the aggregate rate is reported for
+ * each. With the per-cpu magazines the rate should grow with the
+ * number of threads; configure sys161 with more cpus to see further.
+ */
+
+#define BENCH_NALLOCS  20000
+#define BENCH_WORKSET  8
+
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[BENCH_WORKSET];
+	unsigned i, slot;
+
+	for (i=0; i<BENCH_WORKSET; i++) {
+		ptrs[i] = NULL;
+	}
+
+	for (i=0; i<BENCH_NALLOCS; i++) {
+		slot = i % BENCH_WORKSET;
+		kfree(ptrs[slot]);
+		/* 16 to 512 bytes */
+		ptrs[slot] = kmalloc(16 << ((i + num) % 6));
+		if (ptrs[slot] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			break;
+		}
+	}
+
+	for (i=0; i<BENCH_WORKSET; i++) {
+		kfree(ptrs[i]);
+	}
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t usecs, rate;
+	unsigned i, n, ncpus;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	ncpus = cpu_count();
+	kprintf("Starting kmalloc benchmark on %u cpus...\n", ncpus);
+
+	for (n=1; n<=ncpus; n++) {
+		gettime(&s1, &ns1);
+		for (i=0; i<n; i++) {
+			result = thread_fork("mallocbench", NULL,
+					     mallocbenchthread, sem, i);
+			if (result) {
+				panic("mallocbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<n; i++) {
+			P(sem);
+		}
+		gettime(&s2, &ns2);
+		getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+
+		usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+		if (usecs == 0) {
+			usecs = 1;
+		}
+		rate = (uint64_t)n * BENCH_NALLOCS * 1000000 / usecs;
+		kprintf("%2u threads: %lu allocs in %lu.%06lu s, %lu allocs/s\n",
+			n, (unsigned long)n * BENCH_NALLOCS,
+			(unsigned long)secs, (unsigned long)(nsecs / 1000),
+			(unsigned long)rate);
+	}
+
+	sem_destroy(sem);
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
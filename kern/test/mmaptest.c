@@ -0,0 +1,310 @@
+/*
+ * mmaptest - test for shared file mappings
+ *
+ * Writes a file a little over two pages long, maps it with MAP_SHARED
+ * into a fresh address space, and checks that the mapping holds what
+ * the file does. Then copies the address space as fork would, writes
+ * through the copy and checks the original sees it, writes again
+ * through the original, unmaps it, and reads the file back to check
+ * that the last write reached it.
+ *
+ * The mapping needs an address space, so the test runs in a process
+ * of its own, and the menu waits for it like for a user program.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FILENAME "mmaptest.tmp"
+#define FILESIZE (2 * PAGE_SIZE + 100)
+
+/* Set by the test's process before it exits. */
+static int mmaptest_failed;
+
+/*
+ * The byte at OFFSET of the file after write number PASS.
+ */
+static
+char
+mmaptest_byte(size_t offset, int pass)
+{
+	return 'A' + (offset + offset / 26 + pass * 7) % 26;
+}
+
+static
+void
+mmaptest_fill(char *buf, int pass)
+{
+	size_t i;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = mmaptest_byte(i, pass);
+	}
+}
+
+static
+int
+mmaptest_check(const char *what, const char *buf, int pass)
+{
+	size_t i;
+
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != mmaptest_byte(i, pass)) {
+			kprintf("mmaptest: %s: byte %lu is %d, should be %d\n",
+				what, (unsigned long) i, buf[i],
+				mmaptest_byte(i, pass));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Do all of FILESIZE bytes of I/O on VN at offset 0, in direction RW.
+ */
+static
+int
+mmaptest_io(struct vnode *vn, char *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	uio_kinit(&iov, &ku, buf, FILESIZE, 0, rw);
+	err = rw == UIO_READ ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+	if (err) {
+		kprintf("mmaptest: %s error: %s\n",
+			rw == UIO_READ ? "Read" : "Write", strerror(err));
+		return -1;
+	}
+	if (ku.uio_resid > 0) {
+		kprintf("mmaptest: Short %s: %lu bytes left over\n",
+			rw == UIO_READ ? "read" : "write",
+			(unsigned long) ku.uio_resid);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Switch the current process to address space AS.
+ */
+static
+void
+mmaptest_setas(struct addrspace *as)
+{
+	curproc_setas(as);
+	as_activate();
+}
+
+/*
+ * Map VN, which holds pass 0, into AS and run the test proper.
+ */
+static
+int
+mmaptest_map(struct addrspace *as, struct vnode *vn, char *buf)
+{
+	struct addrspace *copy;
+	vaddr_t va;
+	int err;
+
+	err = as_mmap(as, 0, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      vn, 0, &va);
+	if (err) {
+		kprintf("mmaptest: mmap: %s\n", strerror(err));
+		return -1;
+	}
+
+	err = copyin((const_userptr_t)va, buf, FILESIZE);
+	if (err) {
+		kprintf("mmaptest: Reading the mapping: %s\n", strerror(err));
+		return -1;
+	}
+	if (mmaptest_check("mapping", buf, 0)) {
+		return -1;
+	}
+
+	/* Writes through a copy must show through the original. */
+	err = as_copy(as, &copy);
+	if (err) {
+		kprintf("mmaptest: as_copy: %s\n", strerror(err));
+		return -1;
+	}
+	mmaptest_setas(copy);
+	mmaptest_fill(buf, 1);
+	err = copyout(buf, (userptr_t)va, FILESIZE);
+	mmaptest_setas(as);
+	as_destroy(copy);
+	if (err) {
+		kprintf("mmaptest: Writing the copy: %s\n", strerror(err));
+		return -1;
+	}
+	err = copyin((const_userptr_t)va, buf, FILESIZE);
+	if (err) {
+		kprintf("mmaptest: Reading the mapping: %s\n", strerror(err));
+		return -1;
+	}
+	if (mmaptest_check("mapping after writing the copy", buf, 1)) {
+		return -1;
+	}
+
+	mmaptest_fill(buf, 2);
+	err = copyout(buf, (userptr_t)va, FILESIZE);
+	if (err) {
+		kprintf("mmaptest: Writing the mapping: %s\n", strerror(err));
+		return -1;
+	}
+	err = as_munmap(as, va, FILESIZE);
+	if (err) {
+		kprintf("mmaptest: munmap: %s\n", strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static
+int
+domaptest(const char *fs)
+{
+	struct addrspace *as;
+	struct vnode *vn;
+	struct stat st;
+	char name[32];
+	char path[32];
+	char *buf;
+	int err, ret;
+
+	snprintf(name, sizeof(name), "%s:%s", fs, FILENAME);
+	KASSERT(strlen(name) < sizeof(name));
+
+	buf = kmalloc(FILESIZE);
+	if (buf == NULL) {
+		kprintf("mmaptest: Out of memory\n");
+		return -1;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(path, name);
+	err = vfs_open(path, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", name, strerror(err));
+		kfree(buf);
+		return -1;
+	}
+
+	ret = -1;
+	mmaptest_fill(buf, 0);
+	if (mmaptest_io(vn, buf, UIO_WRITE)) {
+		goto out;
+	}
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("mmaptest: Out of memory\n");
+		goto out;
+	}
+	mmaptest_setas(as);
+	ret = mmaptest_map(as, vn, buf);
+	as_deactivate();
+	as = curproc_setas(NULL);
+	as_destroy(as);
+	if (ret) {
+		goto out;
+	}
+
+	ret = -1;
+	if (mmaptest_io(vn, buf, UIO_READ) ||
+	    mmaptest_check(name, buf, 2)) {
+		goto out;
+	}
+	err = VOP_STAT(vn, &st);
+	if (err) {
+		kprintf("mmaptest: stat: %s\n", strerror(err));
+		goto out;
+	}
+	if (st.st_size != FILESIZE) {
+		/* the rest of the last page must not have been written */
+		kprintf("mmaptest: %s is %lu bytes, should be %lu\n", name,
+			(unsigned long) st.st_size, (unsigned long) FILESIZE);
+		goto out;
+	}
+	ret = 0;
+
+ out:
+	vfs_close(vn);
+	strcpy(path, name);
+	vfs_remove(path);
+	kfree(buf);
+	return ret;
+}
+
+static
+void
+mmaptest_thread(void *fs, unsigned long junk)
+{
+	struct proc *p = curproc;
+
+	(void)junk;
+
+	mmaptest_failed = domaptest(fs);
+
+	/* Leave the way sys__exit does; this wakes the menu. */
+	proc_remthread(curthread);
+	proc_destroy(p);
+	thread_exit();
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	struct proc *proc;
+	char *device;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs6 filesystem:\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	kprintf("*** Starting mmap test on %s:\n", device);
+
+	proc = proc_create_runprogram("mmaptest");
+	if (proc == NULL) {
+		return ENOMEM;
+	}
+	result = thread_fork("mmaptest", proc, mmaptest_thread, device, 0);
+	if (result) {
+		kprintf("thread_fork failed: %s\n", strerror(result));
+		proc_destroy(proc);
+		return result;
+	}
+	P(no_proc_sem);
+
+	if (mmaptest_failed) {
+		kprintf("*** Test failed\n");
+		return 0;
+	}
+	kprintf("*** mmap test done\n");
+	return 0;
+}
@@ -32,6 +32,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -347,3 +348,103 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Timed waits. Each should give up when nothing comes, and not when
+ * something does.
+ */
+static struct lock *timedlock;
+static struct cv *timedcv;
+static struct semaphore *timeddone;
+static volatile bool timedflag;
+
+static
+void
+timedtestthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	/* The main thread holds timedlock. */
+	if (lock_tryacquire(timedlock)) {
+		panic("timedtest: lock_tryacquire got a held lock\n");
+	}
+	if (lock_acquire_timeout(timedlock, 2) != ETIMEDOUT) {
+		panic("timedtest: lock_acquire_timeout got a held lock\n");
+	}
+	V(timeddone);
+}
+
+static
+void
+timedsignalthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(timedlock);
+	timedflag = true;
+	cv_signal(timedcv, timedlock);
+	lock_release(timedlock);
+}
+
+int
+timedtest(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting timed wait test...\n");
+	sem = sem_create("timedsem", 0);
+	timedlock = lock_create("timedlock");
+	timedcv = cv_create("timedcv");
+	timeddone = sem_create("timeddone", 0);
+	if (sem == NULL || timedlock == NULL || timedcv == NULL ||
+	    timeddone == NULL) {
+		panic("timedtest: out of memory\n");
+	}
+
+	if (P_timeout(sem, 2) != ETIMEDOUT) {
+		panic("timedtest: P_timeout on zero did not time out\n");
+	}
+	V(sem);
+	if (P_timeout(sem, 2) != 0) {
+		panic("timedtest: P_timeout on one timed out\n");
+	}
+
+	lock_acquire(timedlock);
+	result = thread_fork("timedtest", NULL, timedtestthread, NULL, 0);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	P(timeddone);
+
+	if (cv_wait_timeout(timedcv, timedlock, 2) != ETIMEDOUT) {
+		panic("timedtest: cv_wait_timeout did not time out\n");
+	}
+	KASSERT(lock_do_i_hold(timedlock));
+
+	timedflag = false;
+	result = thread_fork("timedtest", NULL, timedsignalthread, NULL, 0);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	while (!timedflag) {
+		if (cv_wait_timeout(timedcv, timedlock, 1000) != 0) {
+			panic("timedtest: cv_wait_timeout missed a signal\n");
+		}
+	}
+	lock_release(timedlock);
+
+	cv_destroy(timedcv);
+	lock_destroy(timedlock);
+	sem_destroy(timeddone);
+	sem_destroy(sem);
+	kprintf("Timed wait test done.\n");
+	return 0;
+}
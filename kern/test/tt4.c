@@ -0,0 +1,200 @@
+/*
+ * Scheduler latency test.
+ *
+ * Like tt3, mixes threads that mostly sleep with threads that only
+ * compute, but measures how long each sleeper takes to run after it
+ * is woken. Runs once under each scheduling policy (see
+ * thread_setsched) so they can be compared.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define MAXSLEEPERS  16
+#define WAKE_ROUNDS  100	/* times the waker wakes each sleeper */
+
+static struct semaphore *wakesems[MAXSLEEPERS];
+static struct semaphore *donesem;
+static volatile bool pending[MAXSLEEPERS];	/* woken, not yet run */
+static volatile bool testdone;
+
+/* when each sleeper was last woken, and what it has measured */
+static time_t wakesecs[MAXSLEEPERS];
+static uint32_t wakensecs[MAXSLEEPERS];
+static unsigned wakeups[MAXSLEEPERS];
+static uint32_t totalusecs[MAXSLEEPERS];
+static uint32_t maxusecs[MAXSLEEPERS];
+
+static
+void
+setup(int nsleepers)
+{
+	char name[16];
+	int i;
+
+	if (donesem == NULL) {
+		donesem = sem_create("tt4done", 0);
+		if (donesem == NULL) {
+			panic("tt4: sem_create failed\n");
+		}
+		for (i=0; i<MAXSLEEPERS; i++) {
+			snprintf(name, sizeof(name), "tt4wake%d", i);
+			wakesems[i] = sem_create(name, 0);
+			if (wakesems[i] == NULL) {
+				panic("tt4: sem_create failed\n");
+			}
+		}
+	}
+	for (i=0; i<nsleepers; i++) {
+		pending[i] = false;
+		wakeups[i] = 0;
+		totalusecs[i] = 0;
+		maxusecs[i] = 0;
+	}
+	testdone = false;
+}
+
+static
+void
+sleeper_thread(void *junk, unsigned long num)
+{
+	time_t secs, dsecs;
+	uint32_t nsecs, dnsecs, usecs;
+
+	(void)junk;
+
+	while (1) {
+		P(wakesems[num]);
+		if (testdone) {
+			break;
+		}
+		gettime(&secs, &nsecs);
+		getinterval(wakesecs[num], wakensecs[num], secs, nsecs,
+			    &dsecs, &dnsecs);
+		usecs = dsecs * 1000000 + dnsecs / 1000;
+		totalusecs[num] += usecs;
+		if (usecs > maxusecs[num]) {
+			maxusecs[num] = usecs;
+		}
+		wakeups[num]++;
+		pending[num] = false;
+	}
+	V(donesem);
+}
+
+static
+void
+hog_thread(void *junk1, unsigned long junk2)
+{
+	volatile unsigned spins = 0;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (!testdone) {
+		spins++;
+	}
+	V(donesem);
+}
+
+static
+void
+fork_or_panic(const char *name, void (*func)(void *, unsigned long),
+	      unsigned long num)
+{
+	int result;
+
+	result = thread_fork(name, NULL, func, NULL, num);
+	if (result) {
+		panic("tt4: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+static
+void
+runtest4(int nsleepers, int nhogs)
+{
+	char name[16];
+	unsigned total, count, max;
+	int i, r;
+
+	setup(nsleepers);
+	for (i=0; i<nsleepers; i++) {
+		snprintf(name, sizeof(name), "sleeper%d", i);
+		fork_or_panic(name, sleeper_thread, i);
+	}
+	for (i=0; i<nhogs; i++) {
+		snprintf(name, sizeof(name), "hog%d", i);
+		fork_or_panic(name, hog_thread, i);
+	}
+
+	/* Be the waker: each timer tick, wake whoever is waiting. */
+	for (r=0; r<WAKE_ROUNDS; r++) {
+		clocknap(1);
+		for (i=0; i<nsleepers; i++) {
+			if (pending[i]) {
+				continue;
+			}
+			pending[i] = true;
+			gettime(&wakesecs[i], &wakensecs[i]);
+			V(wakesems[i]);
+		}
+	}
+
+	testdone = true;
+	for (i=0; i<nsleepers; i++) {
+		V(wakesems[i]);
+	}
+	for (i=0; i<nsleepers+nhogs; i++) {
+		P(donesem);
+	}
+
+	total = count = max = 0;
+	for (i=0; i<nsleepers; i++) {
+		total += totalusecs[i];
+		count += wakeups[i];
+		if (maxusecs[i] > max) {
+			max = maxusecs[i];
+		}
+	}
+	kprintf("tt4: %s: %u wakeups, latency average %u us, max %u us\n",
+		thread_schedname(), count, count ? total / count : 0, max);
+}
+
+int
+threadtest4(int nargs, char **args)
+{
+	const char *policy;
+	int nsleepers, nhogs;
+
+	if (nargs == 1) {
+		nsleepers = 4;
+		nhogs = 4;
+	}
+	else if (nargs == 3) {
+		nsleepers = atoi(args[1]);
+		nhogs = atoi(args[2]);
+	}
+	else {
+		kprintf("Usage: tt4 [sleepthreads computethreads]\n");
+		return 1;
+	}
+	if (nsleepers < 1 || nsleepers > MAXSLEEPERS || nhogs < 0) {
+		kprintf("tt4: 1 to %d sleepthreads\n", MAXSLEEPERS);
+		return 1;
+	}
+
+	kprintf("Starting thread test 4 (%d sleepers, %d computes)\n",
+		nsleepers, nhogs);
+	policy = thread_schedname();
+	thread_setsched("rr");
+	runtest4(nsleepers, nhogs);
+	thread_setsched("mlfq");
+	runtest4(nsleepers, nhogs);
+	thread_setsched(policy);
+	kprintf("Thread test 4 done\n");
+	return 0;
+}
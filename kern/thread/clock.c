@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -52,26 +53,37 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Sleeping threads wait in a hashed timer wheel. A thread napping
+ * until tick D sleeps on timerwheel[D % TIMER_SLOTS] with t_wakeup
+ * set to D. Each tick, CPU 0 looks only at the slot for that tick and
+ * wakes the threads in it that are due, so a sleeper is woken once
+ * however long it sleeps. Those due on a later turn of the wheel stay
+ * asleep.
  */
-static struct wchan *lbolt;
+#define TIMER_SLOTS	64
+
+static struct wchan *timerwheel[TIMER_SLOTS];
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Timeouts hash into the same slots, on doubly-linked lists. The
+ * callback of the one being run, if any, is timeout_running's; see
+ * timeout_stop.
  */
-static struct wchan *minibolt;
+static struct timeout *timeouts[TIMER_SLOTS];
+static struct timeout *timeout_running;
+static struct spinlock timeout_lock;
 
-/* 
- * number of minibolts per second
+/*
+ * Ticks since boot; one every LT_GRANULARITY usec. Wraps.
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+static volatile unsigned timerticks;
 
-/*
- * minibolt countdown
+/* 
+ * number of ticks per second
  */
-static int minicount;
+#define MINI_PER_SECOND (1000000/LT_GRANULARITY)
 
 /*
  * Setup.
@@ -79,17 +91,135 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned i;
+
+	/* we assume MINI_PER_SECOND > 0 */
+	COMPILE_ASSERT(MINI_PER_SECOND > 0);
+
+	for (i=0; i<TIMER_SLOTS; i++) {
+		timerwheel[i] = wchan_create("timerwheel");
+		if (timerwheel[i] == NULL) {
+			panic("Couldn't create timerwheel\n");
+		}
+		timeouts[i] = NULL;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	spinlock_init(&timeout_lock);
+	timerticks = 0;
+}
+
+unsigned
+clock_ticks(void)
+{
+	return timerticks;
+}
+
+bool
+clock_due(unsigned deadline)
+{
+	/* Compare as a difference, so the counter can wrap. */
+	return (int)(timerticks - deadline) >= 0;
+}
+
+/*
+ * Take a timeout off its slot. Call with timeout_lock held.
+ */
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+	KASSERT(to->to_pending);
+
+	if (to->to_prev != NULL) {
+		to->to_prev->to_next = to->to_next;
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	else {
+		timeouts[to->to_deadline % TIMER_SLOTS] = to->to_next;
+	}
+	if (to->to_next != NULL) {
+		to->to_next->to_prev = to->to_prev;
+	}
+	to->to_pending = false;
+}
+
+void
+timeout_start(struct timeout *to, unsigned deadline,
+	      void (*func)(void *), void *data)
+{
+	unsigned slot;
+
+	spinlock_acquire(&timeout_lock);
+	/*
+	 * timerclock bumps timerticks before taking timeout_lock, so
+	 * any tick after the one we read here will see us.
+	 */
+	if (clock_due(deadline)) {
+		deadline = timerticks + 1;
+	}
+	slot = deadline % TIMER_SLOTS;
+	to->to_deadline = deadline;
+	to->to_func = func;
+	to->to_data = data;
+	to->to_pending = true;
+	to->to_prev = NULL;
+	to->to_next = timeouts[slot];
+	if (to->to_next != NULL) {
+		to->to_next->to_prev = to;
+	}
+	timeouts[slot] = to;
+	spinlock_release(&timeout_lock);
+}
+
+bool
+timeout_stop(struct timeout *to)
+{
+	spinlock_acquire(&timeout_lock);
+	if (to->to_pending) {
+		timeout_unlink(to);
+		spinlock_release(&timeout_lock);
+		return true;
+	}
+	/* Too late; wait for the callback to finish with it. */
+	while (timeout_running == to) {
+		spinlock_release(&timeout_lock);
+		spinlock_acquire(&timeout_lock);
+	}
+	spinlock_release(&timeout_lock);
+	return false;
+}
+
+/*
+ * Run the timeouts in NOW's slot that are due. The lock is dropped
+ * around each callback, so start over from the head after each one.
+ */
+static
+void
+timeout_run(unsigned now)
+{
+	struct timeout *to;
+	void (*func)(void *);
+	void *data;
+
+	spinlock_acquire(&timeout_lock);
+	to = timeouts[now % TIMER_SLOTS];
+	while (to != NULL) {
+		if ((int)(now - to->to_deadline) < 0) {
+			to = to->to_next;
+			continue;
+		}
+		timeout_unlink(to);
+		func = to->to_func;
+		data = to->to_data;
+		timeout_running = to;
+		spinlock_release(&timeout_lock);
+
+		func(data);
+
+		spinlock_acquire(&timeout_lock);
+		timeout_running = NULL;
+		to = timeouts[now % TIMER_SLOTS];
+	}
+	spinlock_release(&timeout_lock);
 }
 
 /*
@@ -99,13 +229,11 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
-	}
+	unsigned now;
+
+	now = ++timerticks;
+	wchan_wakedue(timerwheel[now % TIMER_SLOTS], now);
+	timeout_run(now);
 }
 
 /*
@@ -123,10 +251,9 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	if (thread_tick()) {
+		thread_yield();
 	}
-	thread_yield();
 }
 
 /*
@@ -135,11 +262,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	clocknap(num_secs * MINI_PER_SECOND);
 }
 
 /*
@@ -149,9 +272,24 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	struct wchan *slot;
+	unsigned deadline;
+
+	if (num_ticks <= 0) {
+		return;
+	}
+
+	deadline = timerticks + num_ticks;
+	slot = timerwheel[deadline % TIMER_SLOTS];
+	wchan_lock(slot);
+	/*
+	 * timerclock bumps timerticks before locking the slot, so if
+	 * our tick hasn't come yet it will find us there.
+	 */
+	if (clock_due(deadline)) {
+		wchan_unlock(slot);
+		return;
+	}
+	curthread->t_wakeup = deadline;
+	wchan_sleep(slot);
 }
@@ -41,6 +41,11 @@
  * Spinlocks.
  */
 
+/*
+ * Spin iterations to wait, per CPU ahead of us in line, before
+ * looking at the lock again.
+ */
+#define SPINLOCK_BACKOFF	16
 
 /*
  * Initialize spinlock.
@@ -48,8 +53,14 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+#if OPT_SPINLOCKSTATS
+	lk->lk_acquires = 0;
+	lk->lk_contended = 0;
+	lk->lk_spins = 0;
+#endif
 }
 
 /*
@@ -59,7 +70,8 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
 }
 
 /*
@@ -67,12 +79,17 @@ spinlock_cleanup(struct spinlock *lk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket, and wait for it to come up.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket, serving;
+	volatile unsigned i;
+#if OPT_SPINLOCKSTATS
+	unsigned spins = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +104,31 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	/*
+	 * Only the fetch-and-add is atomic; after that we just read
+	 * lk_serving, which only the holder writes. While waiting,
+	 * back off in proportion to our place in line, so waiters far
+	 * back don't keep hitting the lock word. (Subtraction handles
+	 * the counters wrapping.)
+	 */
+	ticket = spinlock_data_fetchadd(&lk->lk_next, 1);
+	while ((serving = spinlock_data_get(&lk->lk_serving)) != ticket) {
+		for (i = (ticket - serving) * SPINLOCK_BACKOFF; i > 0; i--) {
+			/* nothing */
 		}
-		break;
+#if OPT_SPINLOCKSTATS
+		spins++;
+#endif
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_SPINLOCKSTATS
+	lk->lk_acquires++;
+	if (spins > 0) {
+		lk->lk_contended++;
+		lk->lk_spins += spins;
+	}
+#endif
 }
 
 /*
@@ -122,7 +143,9 @@ spinlock_release(struct spinlock *lk)
 	}
 
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* Let the next ticket in. */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +162,19 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the contention counters. They are read without the lock, so
+ * may be a little inconsistent with each other.
+ */
+void
+spinlock_printstats(struct spinlock *lk, const char *name)
+{
+#if OPT_SPINLOCKSTATS
+	kprintf("%s: %u acquired, %u contended, %u spins\n", name,
+		lk->lk_acquires, lk->lk_contended, lk->lk_spins);
+#else
+	(void)lk;
+	kprintf("%s: not counted (spinlockstats option is off)\n", name);
+#endif
+}
@@ -33,17 +33,43 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <objcache.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/* Cached semaphores keep their spinlock initialized. */
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+}
+
+static struct objcache sem_cache =
+	OBJCACHE_INITIALIZER("semaphore", struct semaphore, sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -51,25 +77,24 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+	sem = objcache_get(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+		objcache_put(&sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		objcache_put(&sem_cache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
         return sem;
@@ -80,16 +105,22 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
+	/* wchan_destroy will assert if anyone's waiting on it */
+	KASSERT(!spinlock_do_i_hold(&sem->sem_lock));
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+	objcache_put(&sem_cache, sem);
 }
 
-void 
-P(struct semaphore *sem)
+/*
+ * P, optionally giving up at tick DEADLINE.
+ */
+static
+int
+sem_wait(struct semaphore *sem, bool timed, unsigned deadline)
 {
+	bool timedout = false;
+
         KASSERT(sem != NULL);
 
         /*
@@ -102,6 +133,11 @@ P(struct semaphore *sem)
 
 	spinlock_acquire(&sem->sem_lock);
         while (sem->sem_count == 0) {
+		/* Only give up once the count has been checked again. */
+		if (timedout) {
+			spinlock_release(&sem->sem_lock);
+			return ETIMEDOUT;
+		}
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
 		 * along in V right this instant the wakeup can't go
@@ -120,13 +156,32 @@ P(struct semaphore *sem)
 		 */
 		wchan_lock(sem->sem_wchan);
 		spinlock_release(&sem->sem_lock);
-                wchan_sleep(sem->sem_wchan);
+		if (timed) {
+			timedout = wchan_sleep_until(sem->sem_wchan, deadline);
+		}
+		else {
+			wchan_sleep(sem->sem_wchan);
+		}
 
 		spinlock_acquire(&sem->sem_lock);
         }
         KASSERT(sem->sem_count > 0);
         sem->sem_count--;
 	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
+void 
+P(struct semaphore *sem)
+{
+	sem_wait(sem, false, 0);
+}
+
+int
+P_timeout(struct semaphore *sem, int ticks)
+{
+	KASSERT(ticks >= 0);
+	return sem_wait(sem, true, clock_ticks() + ticks);
 }
 
 void
@@ -147,24 +202,54 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/* Cached locks keep their spinlock initialized. */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_init(&lock->lk_lock);
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+}
+
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", struct lock, lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+	lock = objcache_get(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+		objcache_put(&lock_cache, lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	lock->lk_wchan = wchan_create(lock->lk_name);
+	if (lock->lk_wchan == NULL) {
+		kfree(lock->lk_name);
+		objcache_put(&lock_cache, lock);
+		return NULL;
+	}
+
+	lock->lk_holder = NULL;
+
         return lock;
 }
 
@@ -172,62 +257,133 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+	KASSERT(lock->lk_holder == NULL);
 
-        // add stuff here as needed
-        
+	/* wchan_destroy will assert if anyone's waiting on it */
+	KASSERT(!spinlock_do_i_hold(&lock->lk_lock));
+	wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
-        kfree(lock);
+	objcache_put(&lock_cache, lock);
+}
+
+/*
+ * Acquire, optionally giving up at tick DEADLINE. Works like
+ * sem_wait with a count of one.
+ */
+static
+int
+lock_wait(struct lock *lock, bool timed, unsigned deadline)
+{
+	bool timedout = false;
+
+	KASSERT(lock != NULL);
+	/* May not block in an interrupt handler. */
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder != curthread);
+	while (lock->lk_holder != NULL) {
+		if (timedout) {
+			spinlock_release(&lock->lk_lock);
+			return ETIMEDOUT;
+		}
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+		if (timed) {
+			timedout = wchan_sleep_until(lock->lk_wchan, deadline);
+		}
+		else {
+			wchan_sleep(lock->lk_wchan);
+		}
+
+		spinlock_acquire(&lock->lk_lock);
+	}
+	lock->lk_holder = curthread;
+	spinlock_release(&lock->lk_lock);
+	return 0;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	lock_wait(lock, false, 0);
+}
 
-        (void)lock;  // suppress warning until code gets written
+int
+lock_acquire_timeout(struct lock *lock, int ticks)
+{
+	KASSERT(ticks >= 0);
+	return lock_wait(lock, true, clock_ticks() + ticks);
+}
+
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool gotit;
+
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder != curthread);
+	gotit = lock->lk_holder == NULL;
+	if (gotit) {
+		lock->lk_holder = curthread;
+	}
+	spinlock_release(&lock->lk_lock);
+	return gotit;
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
+	KASSERT(lock != NULL);
 
-        (void)lock;  // suppress warning until code gets written
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder == curthread);
+	lock->lk_holder = NULL;
+	wchan_wakeone(lock->lk_wchan);
+	spinlock_release(&lock->lk_lock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
+	KASSERT(lock != NULL);
 
-        (void)lock;  // suppress warning until code gets written
-
-        return true; // dummy until code gets written
+	/* Only we can make this true or false for ourselves. */
+	return lock->lk_holder == curthread;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // CV
 
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", struct cv, NULL, NULL);
 
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+	cv = objcache_get(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+		objcache_put(&cv_cache, cv);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	cv->cv_wchan = wchan_create(cv->cv_name);
+	if (cv->cv_wchan == NULL) {
+		kfree(cv->cv_name);
+		objcache_put(&cv_cache, cv);
+		return NULL;
+	}
+
         return cv;
 }
 
@@ -236,32 +392,60 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
-        
+	/* wchan_destroy will assert if anyone's waiting on it */
+	wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
-        kfree(cv);
+	objcache_put(&cv_cache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
-        (void)cv;    // suppress warning until code gets written
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Lock the wchan before releasing the lock, so a signal sent
+	 * between the two can't be missed. wchan_sleep unlocks it.
+	 */
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	wchan_sleep(cv->cv_wchan);
+	lock_acquire(lock);
+}
+
+int
+cv_wait_timeout(struct cv *cv, struct lock *lock, int ticks)
+{
+	unsigned deadline;
+	bool timedout;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+	KASSERT(ticks >= 0);
+
+	deadline = clock_ticks() + ticks;
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	timedout = wchan_sleep_until(cv->cv_wchan, deadline);
+	lock_acquire(lock);
+	return timedout ? ETIMEDOUT : 0;
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeone(cv->cv_wchan);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeall(cv->cv_wchan);
 }
@@ -40,6 +40,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <clock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -50,6 +51,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <objcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -57,6 +59,15 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Scheduling policies and MLFQ parameters; see schedule(). */
+#define SCHED_MLFQ        0
+#define SCHED_RR          1
+#define SCHED_LEVELS      4
+#define SCHED_QUANTUM(l)  (1U << (l))	/* hardclocks at level l */
+#define SCHED_AGE_PASSES  8		/* schedule() calls before aging */
+
+static volatile int sched_policy = SCHED_MLFQ;
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -72,6 +83,20 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Object caches for threads and wait channels. A cached thread keeps
+ * its kernel stack; a cached wait channel keeps its lock and list.
+ */
+static int thread_ctor(void *obj);
+static void thread_dtor(void *obj);
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", struct thread, thread_ctor, thread_dtor);
+static struct objcache wchan_cache =
+	OBJCACHE_INITIALIZER("wchan", struct wchan, wchan_ctor, wchan_dtor);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,9 +136,36 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = kmalloc(STACK_SIZE);
+	if (thread->t_stack == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	kfree(thread->t_stack);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * The thread comes with a stack already allocated (by thread_ctor).
  */
 static
 struct thread *
@@ -123,14 +175,15 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_get(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
+	KASSERT(thread->t_stack != NULL);
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_put(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -139,11 +192,16 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduler fields; new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_waited = 0;
+	thread->t_wakeup = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -154,6 +212,15 @@ thread_create(const char *name)
 	return thread;
 }
 
+/*
+ * Return the number of CPUs.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -180,13 +247,17 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_kmalloc = kmalloc_cpu_create();
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_load = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_sent = 0;
+	c->c_shootdowns_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -210,14 +281,14 @@ cpu_create(unsigned hardware_number)
 		 * cpu. This means we're using the boot stack, which
 		 * can't be freed. (Exercise: what would it take to
 		 * make it possible to free the boot stack?)
+		 *
+		 * The stack thread_create gave us goes unused, so give
+		 * it back.
 		 */
-		/*c->c_curthread->t_stack = ... */
+		kfree(c->c_curthread->t_stack);
+		c->c_curthread->t_stack = NULL;
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
-		}
 		thread_checkstack_init(c->c_curthread);
 	}
 	c->c_curthread->t_cpu = c;
@@ -249,9 +320,6 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,7 +327,15 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+
+	/* The stack stays with the thread in the cache. */
+	if (thread->t_stack != NULL) {
+		objcache_put(&thread_cache, thread);
+	}
+	else {
+		/* boot thread; no stack of its own */
+		objcache_discard(&thread_cache, thread);
+	}
 }
 
 /*
@@ -306,6 +382,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	curcpu->c_load = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +503,132 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a thread on a cpu's run queue, whose lock must be held. Under
+ * MLFQ the queue is kept sorted by priority, and the thread goes
+ * after the others of its level.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+	struct thread *other;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (sched_policy == SCHED_RR) {
+		threadlist_addtail(&c->c_runqueue, t);
+	}
+	else {
+		/* The list's end markers have no thread. */
+		for (tln = c->c_runqueue.tl_tail.tln_prev;
+		     tln->tln_self != NULL; tln = tln->tln_prev) {
+			if (tln->tln_self->t_priority <= t->t_priority) {
+				break;
+			}
+		}
+		other = tln->tln_self;
+		if (other != NULL) {
+			threadlist_insertafter(&c->c_runqueue, other, t);
+		}
+		else {
+			threadlist_addhead(&c->c_runqueue, t);
+		}
+	}
+	c->c_load = c->c_runqueue.tl_count;
+}
+
+/*
+ * Interrupt one idle cpu, other than this one and EXCEPT, so that it
+ * comes looking for work. c_isidle is read without the runqueue lock;
+ * at worst we send a useless interrupt or miss a cpu that will look
+ * at the next hardclock anyway.
+ */
+static
+void
+thread_kickidle(struct cpu *except)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != except && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Work stealing.
+ *
+ * When a cpu runs out of threads it takes one from the tail of the
+ * busiest other cpu's run queue. The tail thread is the one that
+ * would otherwise wait longest (under MLFQ, the lowest priority
+ * one). The busiest cpu is picked by c_load, without taking any
+ * locks but the victim's.
+ *
+ * Because System/161 does not model caches, there is no affinity cost
+ * to weigh against moving a thread.
+ *
+ * Returns true if a thread was put on curcpu's run queue.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, load, maxload;
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		load = c->c_load;
+		if (c != curcpu->c_self && load > maxload) {
+			victim = c;
+			maxload = load;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = victim->c_runqueue.tl_tail.tln_prev->tln_self;
+	/*
+	 * The victim's curthread can be on its run queue if it went
+	 * to sleep, the cpu went idle, and it was woken up again
+	 * before the cpu got around to running it. Moving it would
+	 * have two cpus on its stack, so leave it be.
+	 */
+	if (t != NULL && t != victim->c_curthread) {
+		threadlist_remove(&victim->c_runqueue, t);
+		victim->c_load = victim->c_runqueue.tl_count;
+	}
+	else {
+		t = NULL;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	t->t_cpu = curcpu->c_self;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_enqueue(curcpu->c_self, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +653,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +661,10 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/* Let an idle cpu steal it rather than have it wait. */
+		thread_kickidle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -492,12 +699,7 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
+	/* The stack came with the thread */
 	thread_checkstack_init(newthread);
 
 	/*
@@ -588,6 +790,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/* Blocking before the quantum is up earns a boost. */
+		if (cur->t_ticks < SCHED_QUANTUM(cur->t_priority) &&
+		    cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -633,13 +841,22 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
+		curcpu->c_load = curcpu->c_runqueue.tl_count;
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Steal a thread from a busier cpu; failing
+			 * that, do VM housekeeping, or if there is
+			 * none, sleep.
+			 */
+			if (!thread_steal() && !vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	next->t_waited = 0;
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -651,8 +868,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_curthread = next;
 	curthread = next;
 
-	/* do the switch (in assembler in switch.S) */
-	switchframe_switch(&cur->t_context, &next->t_context);
+	/*
+	 * Do the switch (in assembler in switch.S). Under MLFQ a
+	 * yielding thread can come straight back off the queue.
+	 */
+	if (next != cur) {
+		switchframe_switch(&cur->t_context, &next->t_context);
+	}
 
 	/*
 	 * When we get to this point we are either running in the next
@@ -822,139 +1044,111 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Multilevel feedback queue: each thread has a priority level, from
+ * 0 (highest) to SCHED_LEVELS-1, and the run queue is kept sorted by
+ * level, round-robin within a level. New threads start at level 0.
+ * A thread at level L may run for SCHED_QUANTUM(L) hardclocks before
+ * it must give way to the others of its level; if it uses all of that
+ * it drops a level, and if it blocks before then it rises one. So
+ * threads that compute sink, with longer quanta, and threads that
+ * mostly wait stay high and run soon after they wake. A thread is
+ * preempted at the next hardclock when one of a higher level is
+ * ready (see thread_tick).
+ *
+ * schedule() is called every SCHEDULE_HARDCLOCKS from hardclock() and
+ * ages the run queue: a thread that has been waiting for
+ * SCHED_AGE_PASSES calls rises a level, so that nothing starves.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
-
-/*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
- */
-void
-thread_consider_migration(void)
-{
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct threadlist aged;
+	struct thread *t, *next;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (sched_policy == SCHED_RR) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+	threadlist_init(&aged);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	for (t = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	     t != NULL; t = next) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (++t->t_waited >= SCHED_AGE_PASSES && t->t_priority > 0) {
+			t->t_priority--;
+			t->t_waited = 0;
+			threadlist_remove(&curcpu->c_runqueue, t);
+			threadlist_addtail(&aged, t);
+		}
+	}
+	while ((t = threadlist_remhead(&aged)) != NULL) {
+		thread_enqueue(curcpu->c_self, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&aged);
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+bool
+thread_tick(void)
+{
+	struct thread *cur, *head;
+	bool preempt;
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
+	cur = curthread;
+	if (sched_policy == SCHED_RR || curcpu->c_isidle) {
+		return true;
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	if (++cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		/* Used it all; drop a level and let the others go. */
+		if (cur->t_priority < SCHED_LEVELS - 1) {
+			cur->t_priority++;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	head = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	preempt = head != NULL && head->t_priority < cur->t_priority;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+int
+thread_setsched(const char *name)
+{
+	if (!strcmp(name, "rr")) {
+		sched_policy = SCHED_RR;
+	}
+	else if (!strcmp(name, "mlfq")) {
+		sched_policy = SCHED_MLFQ;
+	}
+	else {
+		return EINVAL;
 	}
+	return 0;
+}
+
+const char *
+thread_schedname(void)
+{
+	return sched_policy == SCHED_RR ? "rr" : "mlfq";
+}
+
+void
+thread_printlockstats(void)
+{
+	struct cpu *c;
+	char name[32];
+	unsigned i;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		snprintf(name, sizeof(name), "cpu%u runqueue", c->c_number);
+		spinlock_printstats(&c->c_runqueue_lock, name);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -963,6 +1157,30 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Constructor and destructor for wchan_cache.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,12 +1194,10 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_get(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
@@ -993,9 +1209,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	objcache_put(&wchan_cache, wc);
 }
 
 /*
@@ -1028,6 +1244,74 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * For wchan_sleep_until: the timeout's view of who is sleeping where,
+ * and whether it was the one that woke them.
+ */
+struct wchan_alarm {
+	struct wchan *wa_wchan;
+	struct thread *wa_thread;
+	bool wa_timedout;
+};
+
+/*
+ * Timeout callback for wchan_sleep_until. If the thread is still on
+ * the channel, take it off and wake it; if not, someone else already
+ * has.
+ */
+static
+void
+wchan_alarm(void *data)
+{
+	struct wchan_alarm *wa = data;
+	struct threadlistnode *tln;
+	struct wchan *wc = wa->wa_wchan;
+
+	spinlock_acquire(&wc->wc_lock);
+	/* The list's end markers have no thread. */
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_self != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == wa->wa_thread) {
+			threadlist_remove(&wc->wc_threads, wa->wa_thread);
+			wa->wa_timedout = true;
+			break;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (wa->wa_timedout) {
+		thread_make_runnable(wa->wa_thread, false);
+	}
+}
+
+/*
+ * Like wchan_sleep, but give up at tick DEADLINE (see clock.h).
+ * Returns true if the deadline was what woke us.
+ */
+bool
+wchan_sleep_until(struct wchan *wc, unsigned deadline)
+{
+	struct wchan_alarm wa;
+	struct timeout to;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	if (clock_due(deadline)) {
+		wchan_unlock(wc);
+		return true;
+	}
+
+	wa.wa_wchan = wc;
+	wa.wa_thread = curthread;
+	wa.wa_timedout = false;
+	timeout_start(&to, deadline, wchan_alarm, &wa);
+	thread_switch(S_SLEEP, wc);
+	timeout_stop(&to);
+	return wa.wa_timedout;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1090,6 +1374,40 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up the threads sleeping on a wait channel whose t_wakeup tick
+ * has been reached, leaving the others asleep.
+ */
+void
+wchan_wakedue(struct wchan *wc, unsigned now)
+{
+	struct threadlistnode *tln, *next;
+	struct thread *target;
+	struct threadlist list;
+
+	threadlist_init(&list);
+
+	spinlock_acquire(&wc->wc_lock);
+	/* The list's end markers have no thread. */
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_self != NULL;
+	     tln = next) {
+		next = tln->tln_next;
+		target = tln->tln_self;
+		/* Compare as a difference, so the counter can wrap. */
+		if ((int)(now - target->t_wakeup) >= 0) {
+			threadlist_remove(&wc->wc_threads, target);
+			threadlist_addtail(&list, target);
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_make_runnable(target, false);
+	}
+
+	threadlist_cleanup(&list);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1140,9 +1458,10 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	unsigned ticket;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
@@ -1151,15 +1470,29 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
-	else {
+	else if (n != TLBSHOOTDOWN_ALL) {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	ticket = ++target->c_shootdowns_sent;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	/* With interrupts off (spinlocks too), two waiters could deadlock. */
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	/* Tickets wrap around, so compare the difference. */
+	while ((int)(target->c_shootdowns_done - ticket) < 0) {
+		/* spin; the target takes the IPI as soon as it can */
+	}
 }
 
 void
@@ -1202,6 +1535,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done = curcpu->c_shootdowns_sent;
 	}
 
 	curcpu->c_ipi_pending = 0;
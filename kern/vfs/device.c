@@ -241,15 +241,17 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mappings are paged through vop_read and vop_write a page
+ * at a time, which doesn't make sense for devices, so none can be
+ * mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return EUNIMP;
+	(void)prot;
+	return ENODEV;
 }
 
 /*
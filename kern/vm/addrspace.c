@@ -0,0 +1,938 @@
+#define ASINLINE
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <machine/vmtlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
+
+/*
+ * Address spaces.
+ *
+ * An address space is a set of regions and a page table. Nothing is
+ * allocated for a region when it is defined; vm_fault allocates and
+ * zero-fills each page the first time it is touched.
+ *
+ * as_copy shares pages copy-on-write: both page tables point to the
+ * same frame, with PTE_WRITE cleared and the frame's coremap reference
+ * count raised. A write to such a page in a writable region faults,
+ * and vm_fault gives the writer a private copy (or, if it is the last
+ * one sharing the frame, just makes it writable again). Shared frames
+ * have no owner in the coremap, so they are not evicted; the process
+ * left holding one takes it back on its next fault on it.
+ *
+ * mmap adds file-backed regions. A MAP_SHARED region keeps track of
+ * nothing beyond what the page table does: a page has changed since
+ * it was read from the file if it is dirty or has a copy in swap, and
+ * those are the pages written back when the region goes away.
+ *
+ * Page tables are only touched holding the page table lock (see
+ * pagetable.h).
+ */
+
+/* Stacks start at one page and may grow to VM_STACKLIMIT (4M) */
+#define VM_STACKPAGES    1
+#define VM_STACKLIMIT    1024
+
+static unsigned stacklimit = VM_STACKLIMIT;
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	regionarray_init(&as->as_regions);
+	as->as_loading = false;
+	bzero(&as->as_asids, sizeof(as->as_asids));
+	as->as_falast = 0;
+	as->as_fawindow = 0;
+	as->as_heap = NULL;
+	as->as_brk = 0;
+	as->as_stack = NULL;
+
+	return as;
+}
+
+/*
+ * Free the page whose PTE is *PTE, waiting for it if it is busy. Call
+ * with the page table lock held.
+ */
+static
+int
+as_freepage(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	(void)vaddr;
+	(void)data;
+
+	while (*pte & PTE_BUSY) {
+		pt_waitbusy();
+	}
+	if (*pte & PTE_VALID) {
+		swap_freeframe(*pte & PTE_FRAME);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(*pte));
+	}
+	*pte = 0;
+	return 0;
+}
+
+/*
+ * Free the pages of AS in [START, END), dropping them from the TLB of
+ * every cpu before their frames can go to anyone else.
+ */
+static
+void
+as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte, old;
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			/* only we can make it nonzero */
+			continue;
+		}
+		pt_lock();
+		while (*pte & PTE_BUSY) {
+			pt_waitbusy();
+		}
+		old = *pte;
+		*pte = 0;
+		pt_unlock();
+
+		vmtlb_invalidate(&as->as_asids, va);
+
+		pt_lock();
+		as_freepage(va, &old, NULL);
+		pt_unlock();
+	}
+}
+
+/*
+ * Write the page of shared mapping RG at VADDR, whose PTE is *PTE,
+ * back to the file if it has changed. The page is busy meanwhile, so
+ * it stays put without our holding the page table lock.
+ */
+static
+int
+as_writepage(struct region *rg, vaddr_t vaddr, pte_t *pte)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	paddr_t pa;
+	pte_t old;
+	int result;
+
+	start = vaddr < rg->rg_fvaddr ? rg->rg_fvaddr : vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (end > rg->rg_fvaddr + rg->rg_filesz) {
+		end = rg->rg_fvaddr + rg->rg_filesz;
+	}
+	if (start >= end) {
+		/* past the end of the file */
+		return 0;
+	}
+
+	pt_lock();
+	while (*pte & PTE_BUSY) {
+		pt_waitbusy();
+	}
+	old = *pte;
+	if ((old & PTE_VALID) ? ((old & PTE_DIRTY) == 0 &&
+				 coremap_getslot(old & PTE_FRAME) ==
+				 COREMAP_NOSLOT) :
+	    (old & PTE_SWAPPED) == 0) {
+		/* unchanged since it was read from the file */
+		pt_unlock();
+		return 0;
+	}
+	*pte = old | PTE_BUSY;
+	pt_unlock();
+
+	if (old & PTE_VALID) {
+		pa = old & PTE_FRAME;
+	}
+	else {
+		pa = swap_getpages(1);
+		if (pa == 0) {
+			result = ENOMEM;
+			goto done;
+		}
+		result = swap_read(PTE_SLOT(old), pa);
+		if (result) {
+			coremap_free(pa);
+			goto done;
+		}
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(pa) + start - vaddr),
+		  end - start, rg->rg_foffset + (start - rg->rg_fvaddr),
+		  UIO_WRITE);
+	result = VOP_WRITE(rg->rg_vnode, &ku);
+
+	if ((old & PTE_VALID) == 0) {
+		coremap_free(pa);
+	}
+ done:
+	pt_lock();
+	*pte = old;
+	pt_wakebusy();
+	pt_unlock();
+	return result;
+}
+
+/*
+ * Write back the changed pages of shared mapping RG.
+ */
+static
+int
+as_writeback(struct addrspace *as, struct region *rg)
+{
+	vaddr_t va;
+	pte_t *pte;
+	int result;
+
+	KASSERT(rg->rg_backing == RGB_SHARED);
+	for (va = rg->rg_vbase; va < rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	     va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		result = as_writepage(rg, va, pte);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned i;
+
+	vmtlb_forget(as->as_pt->pt_dir);
+	for (i=0; i<regionarray_num(&as->as_regions); i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_backing == RGB_SHARED) {
+			/* nobody to report failure to */
+			as_writeback(as, rg);
+		}
+	}
+	/* Its entries may be on any cpu it ran on; the frames are going. */
+	vmtlb_invalidateall(&as->as_asids);
+	pt_lock();
+	pt_foreach(as->as_pt, as_freepage, NULL);
+	pt_unlock();
+	pt_destroy(as->as_pt);
+
+	for (i=0; i<regionarray_num(&as->as_regions); i++) {
+		rg = regionarray_get(&as->as_regions, i);
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+	regionarray_setsize(&as->as_regions, 0);
+	regionarray_cleanup(&as->as_regions);
+	kfree(as);
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/* Kernel threads don't have an address space to activate */
+		return;
+	}
+
+	/* Usually keeps the TLB; see vmtlb.h. */
+	vmtlb_activate(&as->as_asids, as->as_pt->pt_dir);
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
+
+/*
+ * Return the number of regions of AS that start at or below VADDR,
+ * which is where a region starting at VADDR would go.
+ */
+static
+unsigned
+as_search(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = regionarray_num(&as->as_regions);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (regionarray_get(&as->as_regions, mid)->rg_vbase <= vaddr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Return the index of region RG of AS.
+ */
+static
+unsigned
+as_regionindex(struct addrspace *as, struct region *rg)
+{
+	unsigned i;
+
+	/* Only an empty heap can share its start with another. */
+	i = as_search(as, rg->rg_vbase);
+	do {
+		KASSERT(i > 0);
+		i--;
+	} while (regionarray_get(&as->as_regions, i) != rg);
+	return i;
+}
+
+/*
+ * Return the region after RG in AS, or NULL.
+ */
+static
+struct region *
+as_nextregion(struct addrspace *as, struct region *rg)
+{
+	unsigned i;
+
+	i = as_regionindex(as, rg) + 1;
+	if (i == regionarray_num(&as->as_regions)) {
+		return NULL;
+	}
+	return regionarray_get(&as->as_regions, i);
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i;
+
+	i = as_search(as, vaddr);
+	if (i == 0) {
+		return NULL;
+	}
+	rg = regionarray_get(&as->as_regions, i - 1);
+	if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		return rg;
+	}
+	return NULL;
+}
+
+/*
+ * Add an anonymous region, keeping the array sorted, and hand it back
+ * in RET if that isn't NULL. Fails if it overlaps one that is already
+ * there.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vaddr, size_t npages, int perms,
+	     struct region **ret)
+{
+	struct region *rg, *other;
+	vaddr_t top;
+	unsigned i, j, num;
+	int result;
+
+	top = vaddr + npages * PAGE_SIZE;
+	if (top > USERSPACETOP || top < vaddr) {
+		return EFAULT;
+	}
+
+	i = as_search(as, vaddr);
+	num = regionarray_num(&as->as_regions);
+	if (i > 0) {
+		other = regionarray_get(&as->as_regions, i - 1);
+		if (vaddr < other->rg_vbase + other->rg_npages * PAGE_SIZE) {
+			return EINVAL;
+		}
+	}
+	if (i < num) {
+		other = regionarray_get(&as->as_regions, i);
+		if (other->rg_vbase < top) {
+			return EINVAL;
+		}
+	}
+
+	rg = kmalloc(sizeof(*rg));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_perms = perms;
+	rg->rg_backing = RGB_ANON;
+	rg->rg_vnode = NULL;
+	rg->rg_fvaddr = 0;
+	rg->rg_foffset = 0;
+	rg->rg_filesz = 0;
+
+	/* Make room at I and slide the rest up. */
+	result = regionarray_add(&as->as_regions, rg, NULL);
+	if (result) {
+		kfree(rg);
+		return result;
+	}
+	for (j = num; j > i; j--) {
+		regionarray_set(&as->as_regions, j,
+				regionarray_get(&as->as_regions, j - 1));
+	}
+	regionarray_set(&as->as_regions, i, rg);
+
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
+
+/*
+ * Common code for as_define_region and as_define_fileregion.
+ */
+static
+int
+as_defineit(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	    int readable, int writeable, int executable,
+	    struct region **ret)
+{
+	int perms;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (sz == 0) {
+		return EFAULT;
+	}
+
+	perms = (readable ? RG_READ : 0) | (writeable ? RG_WRITE : 0) |
+		(executable ? RG_EXEC : 0);
+
+	return as_addregion(as, vaddr, sz / PAGE_SIZE, perms, ret);
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	return as_defineit(as, vaddr, sz, readable, writeable, executable,
+			   NULL);
+}
+
+int
+as_define_fileregion(struct addrspace *as, vaddr_t vaddr, size_t memsz,
+		     struct vnode *v, off_t offset, size_t filesz,
+		     int readable, int writeable, int executable)
+{
+	struct region *rg;
+	int result;
+
+	if (filesz > memsz) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesz = memsz;
+	}
+
+	result = as_defineit(as, vaddr, memsz, readable, writeable,
+			     executable, &rg);
+	if (result) {
+		return result;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_backing = RGB_FILE;
+	rg->rg_vnode = v;
+	rg->rg_fvaddr = vaddr;
+	rg->rg_foffset = offset;
+	rg->rg_filesz = filesz;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/*
+	 * Let the loader write into read-only regions. Pages are
+	 * still only allocated as the loader touches them.
+	 */
+	as->as_loading = true;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned num;
+	int result;
+
+	KASSERT(as->as_loading);
+	as->as_loading = false;
+
+	/*
+	 * Drop any writable TLB entries made for read-only pages, on
+	 * whichever cpus the loader ran.
+	 */
+	vmtlb_invalidateall(&as->as_asids);
+
+	/* The heap starts out empty, after the last loaded region. */
+	num = regionarray_num(&as->as_regions);
+	if (num == 0) {
+		return 0;
+	}
+	rg = regionarray_get(&as->as_regions, num - 1);
+	result = as_addregion(as, rg->rg_vbase + rg->rg_npages * PAGE_SIZE, 0,
+			      RG_READ | RG_WRITE, &as->as_heap);
+	if (result) {
+		return result;
+	}
+	as->as_brk = as->as_heap->rg_vbase;
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	result = as_addregion(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+			      VM_STACKPAGES, RG_READ | RG_WRITE, &as->as_stack);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+struct region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack, *rg;
+	unsigned i;
+
+	stack = as->as_stack;
+	vaddr &= PAGE_FRAME;
+	if (stack == NULL || vaddr >= stack->rg_vbase ||
+	    vaddr < USERSTACK - stacklimit * PAGE_SIZE) {
+		return NULL;
+	}
+
+	/* Don't run into the region below (normally the heap). */
+	i = as_regionindex(as, stack);
+	if (i > 0) {
+		rg = regionarray_get(&as->as_regions, i - 1);
+		if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > vaddr) {
+			return NULL;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_vbase - vaddr) / PAGE_SIZE;
+	stack->rg_vbase = vaddr;
+	return stack;
+}
+
+int
+as_setstacklimit(unsigned npages)
+{
+	if (npages == 0 || npages > USERSTACK / PAGE_SIZE) {
+		return EINVAL;
+	}
+	stacklimit = npages;
+	return 0;
+}
+
+unsigned
+as_getstacklimit(void)
+{
+	return stacklimit;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct region *heap, *next;
+	vaddr_t brk, ceiling;
+	size_t npages;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return EINVAL;
+	}
+	brk = as->as_brk + amount;
+	if (amount < 0 && (brk > as->as_brk || brk < heap->rg_vbase)) {
+		return EINVAL;
+	}
+
+	/* Leave the stack all the room it may grow into. */
+	ceiling = USERSTACK - stacklimit * PAGE_SIZE;
+	next = as_nextregion(as, heap);
+	if (next != NULL && next->rg_vbase < ceiling) {
+		ceiling = next->rg_vbase;
+	}
+	if (amount > 0 && (brk < as->as_brk || brk > ceiling)) {
+		return ENOMEM;
+	}
+
+	npages = (brk - heap->rg_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages < heap->rg_npages) {
+		/* Free whatever was touched in the pages taken away. */
+		as_freerange(as, heap->rg_vbase + npages * PAGE_SIZE,
+			     heap->rg_vbase + heap->rg_npages * PAGE_SIZE);
+	}
+	heap->rg_npages = npages;
+
+	*oldbrk = as->as_brk;
+	as->as_brk = brk;
+	return 0;
+}
+
+/*
+ * Find room for NPAGES pages for a mapping, as high as possible
+ * below the stack's room, and hand back its start in RET.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t top, rgtop;
+	size_t size;
+	unsigned i;
+
+	size = npages * PAGE_SIZE;
+	top = USERSTACK - stacklimit * PAGE_SIZE;
+	for (i = regionarray_num(&as->as_regions); i > 0; i--) {
+		rg = regionarray_get(&as->as_regions, i - 1);
+		if (rg->rg_vbase >= top) {
+			continue;
+		}
+		rgtop = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rgtop <= top && top - rgtop >= size) {
+			break;
+		}
+		top = rg->rg_vbase;
+	}
+
+	/* Keep page 0 unmapped. */
+	if (top < size + PAGE_SIZE) {
+		return ENOMEM;
+	}
+	*ret = top - size;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot, int flags,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct region *rg;
+	struct stat st;
+	size_t npages;
+	int perms, sharing, result;
+
+	sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+	    (sharing != MAP_SHARED && sharing != MAP_PRIVATE) ||
+	    (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED)) != 0) {
+		return EINVAL;
+	}
+	if ((flags & MAP_FIXED) && (vaddr == 0 || vaddr % PAGE_SIZE != 0)) {
+		return EINVAL;
+	}
+
+	result = VOP_MMAP(v, prot);
+	if (result) {
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0) {
+		/* len wrapped around */
+		return ENOMEM;
+	}
+	if ((flags & MAP_FIXED) == 0) {
+		result = as_findgap(as, npages, &vaddr);
+		if (result) {
+			return result;
+		}
+	}
+
+	perms = ((prot & PROT_READ) ? RG_READ : 0) |
+		((prot & PROT_WRITE) ? RG_WRITE : 0) |
+		((prot & PROT_EXEC) ? RG_EXEC : 0);
+	result = as_addregion(as, vaddr, npages, perms, &rg);
+	if (result) {
+		return result;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_backing = sharing == MAP_SHARED ? RGB_SHARED : RGB_FILE;
+	rg->rg_vnode = v;
+	rg->rg_fvaddr = vaddr;
+	rg->rg_foffset = offset;
+	rg->rg_filesz = 0;
+	if (st.st_size > offset) {
+		/* The rest reads as zeros. */
+		rg->rg_filesz = st.st_size - offset < (off_t)len ?
+			st.st_size - offset : len;
+	}
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	int result;
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_vbase != vaddr ||
+	    rg->rg_npages != (len + PAGE_SIZE - 1) / PAGE_SIZE ||
+	    rg->rg_backing == RGB_ANON) {
+		/* Only whole mappings can be removed. */
+		return EINVAL;
+	}
+
+	if (rg->rg_backing == RGB_SHARED) {
+		result = as_writeback(as, rg);
+		if (result) {
+			return result;
+		}
+	}
+	as_freerange(as, rg->rg_vbase, rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+
+	regionarray_remove(&as->as_regions, as_regionindex(as, rg));
+	VOP_DECREF(rg->rg_vnode);
+	kfree(rg);
+	return 0;
+}
+
+/*
+ * Share the page at VADDR, whose PTE is *PTE, copy-on-write with the
+ * new address space DATA. Pages of shared mappings are left to
+ * as_sharefile.
+ */
+static
+int
+as_sharepage(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct addrspace *new = data;
+	struct region *rg;
+	pte_t *newpte, old;
+	paddr_t pa;
+	int result;
+
+	rg = as_findregion(new, vaddr);
+	if (rg != NULL && rg->rg_backing == RGB_SHARED) {
+		return 0;
+	}
+
+	/* First, since making a leaf may evict the page. */
+	newpte = pt_lookup(new->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
+
+	pt_lock();
+	while (*pte & PTE_BUSY) {
+		pt_waitbusy();
+	}
+	if (*pte & PTE_SWAPPED) {
+		/* Slots aren't shared; give the copy its own page. */
+		old = *pte;
+		*pte = old | PTE_BUSY;
+		pt_unlock();
+
+		pa = swap_getpages(1);
+		if (pa == 0) {
+			result = ENOMEM;
+		}
+		else {
+			result = swap_read(PTE_SLOT(old), pa);
+			if (result) {
+				coremap_free(pa);
+			}
+		}
+
+		pt_lock();
+		*pte = old;
+		pt_wakebusy();
+		if (result == 0) {
+			*newpte = pa | PTE_VALID | PTE_DIRTY;
+			coremap_setowner(pa, new, vaddr);
+		}
+		pt_unlock();
+		return result;
+	}
+	if ((*pte & PTE_VALID) == 0) {
+		/* evicted clean; both will make it again */
+		pt_unlock();
+		return 0;
+	}
+
+	*pte &= ~PTE_WRITE;
+	coremap_ref(*pte & PTE_FRAME);
+	coremap_setowner(*pte & PTE_FRAME, NULL, 0);
+	*newpte = *pte;
+	pt_unlock();
+	return 0;
+}
+
+/*
+ * Share the pages of shared mapping RG of OLD with NEW, writable by
+ * both, so that each sees what the other writes. There is no cache of
+ * file pages to meet in, so pages OLD doesn't have in memory are
+ * brought in now rather than each reading its own copy later.
+ */
+static
+int
+as_sharefile(struct addrspace *old, struct addrspace *new,
+	     struct region *rg)
+{
+	vaddr_t va, end;
+	pte_t *pte, *newpte;
+	paddr_t pa;
+	int result;
+
+	end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	for (va = rg->rg_vbase; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(old->as_pt, va, true);
+		newpte = pt_lookup(new->as_pt, va, true);
+		if (pte == NULL || newpte == NULL) {
+			return ENOMEM;
+		}
+
+		pt_lock();
+		while (1) {
+			if (*pte & PTE_BUSY) {
+				pt_waitbusy();
+				continue;
+			}
+			if ((*pte & PTE_VALID) == 0) {
+				result = vm_getpage(old, rg, va, VM_FAULT_READ,
+						    pte);
+				if (result) {
+					pt_unlock();
+					return result;
+				}
+				continue;
+			}
+			break;
+		}
+		pa = *pte & PTE_FRAME;
+		coremap_ref(pa);
+		coremap_setowner(pa, NULL, 0);
+		*newpte = *pte;
+		pt_unlock();
+	}
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct region *rg, *newrg;
+	unsigned i;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<regionarray_num(&old->as_regions); i++) {
+		rg = regionarray_get(&old->as_regions, i);
+		result = as_addregion(new, rg->rg_vbase, rg->rg_npages,
+				      rg->rg_perms, &newrg);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+		if (rg == old->as_stack) {
+			new->as_stack = newrg;
+		}
+		if (rg->rg_backing != RGB_ANON) {
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_backing = rg->rg_backing;
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_fvaddr = rg->rg_fvaddr;
+			newrg->rg_foffset = rg->rg_foffset;
+			newrg->rg_filesz = rg->rg_filesz;
+		}
+	}
+
+	/*
+	 * Share every page the old process has touched. The TLB of any
+	 * cpu it has run on may still let it write them, so drop its
+	 * entries everywhere (even on failure, since some pages may
+	 * already be shared).
+	 */
+	new->as_brk = old->as_brk;
+
+	result = pt_foreach(old->as_pt, as_sharepage, new);
+	for (i=0; result == 0 && i<regionarray_num(&old->as_regions); i++) {
+		rg = regionarray_get(&old->as_regions, i);
+		if (rg->rg_backing == RGB_SHARED) {
+			result = as_sharefile(old, new, rg);
+		}
+	}
+	vmtlb_invalidateall(&old->as_asids);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
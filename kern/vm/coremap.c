@@ -0,0 +1,568 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+
+/*
+ * Coremap.
+ *
+ * There is one struct cm_entry per managed page frame. The map itself
+ * lives in the first few pages of the memory handed over by
+ * ram_getsize; frame 0 of the map is the first page after it.
+ *
+ * A free run of N frames starting at frame I has CME_FREE set and
+ * cme_npages == N in both entry I and entry I+N-1, and entry I is on
+ * the free list for bucket log2(N). An allocated run has CME_HEAD and
+ * cme_npages set in its first entry only; coremap_free uses that to
+ * know how much to give back. The first entry also holds the run's
+ * reference count, which is 1 unless coremap_ref has been used to
+ * share the page.
+ *
+ * Up to CM_ZEROPOOL free single pages are kept already zeroed, filled
+ * in when a cpu is idle. They have CME_ZEROED set instead of CME_FREE,
+ * so they are never merged into free runs, but they count as free; an
+ * ordinary allocation takes one only when there is nothing else.
+ *
+ * A single page holding a user page also records which address space
+ * and virtual page it holds (if it is a candidate for eviction) and
+ * the swap slot with a copy of it.
+ */
+
+#define CM_NONE      0xffffffff	/* null frame index */
+
+#define CME_FREE     0x1	/* frame is free */
+#define CME_HEAD     0x2	/* first frame of an allocated run */
+#define CME_ZEROED   0x4	/* in the pool of zeroed pages */
+
+struct cm_entry {
+	uint32_t cme_flags;
+	uint32_t cme_npages;	/* run length, see above */
+	uint32_t cme_next;	/* free list links (head of free run only) */
+	uint32_t cme_prev;
+	uint32_t cme_refs;	/* references (head of allocated run only) */
+	struct addrspace *cme_as;	/* owner of user page, or NULL */
+	vaddr_t cme_vaddr;	/* its address there */
+	unsigned cme_slot;	/* swap copy, or COREMAP_NOSLOT */
+};
+
+/* Free runs of 2^i to 2^(i+1)-1 pages live on bucket i. */
+#define CM_NBUCKETS  20
+
+static struct cm_entry *coremap;
+static paddr_t cm_base;		/* physical address of frame 0 */
+static unsigned cm_nframes;	/* number of managed frames */
+static unsigned cm_nfree;	/* number of free frames */
+static uint32_t cm_buckets[CM_NBUCKETS];
+static uint32_t cm_hand;	/* clock hand */
+
+#define CM_ZEROPOOL  16
+static uint32_t cm_zeroed[CM_ZEROPOOL];	/* pool of zeroed pages */
+static unsigned cm_nzeroed;
+static unsigned cm_nzeroing;		/* pages being zeroed for it */
+static bool cm_ready = false;
+
+/*
+ * Protects everything above, and ram_stealmem before bootstrap.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+//
+// Free-run lists
+
+static
+unsigned
+cm_bucket(unsigned npages)
+{
+	unsigned b = 0;
+
+	KASSERT(npages > 0);
+	while (npages > 1 && b < CM_NBUCKETS-1) {
+		npages >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static
+void
+cm_insert(uint32_t ix)
+{
+	unsigned b;
+
+	b = cm_bucket(coremap[ix].cme_npages);
+	coremap[ix].cme_prev = CM_NONE;
+	coremap[ix].cme_next = cm_buckets[b];
+	if (cm_buckets[b] != CM_NONE) {
+		coremap[cm_buckets[b]].cme_prev = ix;
+	}
+	cm_buckets[b] = ix;
+}
+
+static
+void
+cm_remove(uint32_t ix)
+{
+	struct cm_entry *e = &coremap[ix];
+
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		unsigned b = cm_bucket(e->cme_npages);
+		KASSERT(cm_buckets[b] == ix);
+		cm_buckets[b] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+}
+
+/*
+ * Tag [ix, ix+npages) as one free run and put it on its list.
+ */
+static
+void
+cm_setfree(uint32_t ix, unsigned npages)
+{
+	uint32_t last = ix + npages - 1;
+
+	coremap[ix].cme_flags = CME_FREE;
+	coremap[ix].cme_npages = npages;
+	coremap[last].cme_flags = CME_FREE;
+	coremap[last].cme_npages = npages;
+	cm_insert(ix);
+}
+
+/*
+ * Find a free run of at least NPAGES frames. Runs on a higher bucket
+ * than NPAGES's own are always big enough, so only that one bucket is
+ * ever searched; the common single-page case takes the first entry.
+ */
+static
+uint32_t
+cm_findrun(unsigned npages)
+{
+	unsigned b;
+	uint32_t ix;
+
+	b = cm_bucket(npages);
+	for (ix = cm_buckets[b]; ix != CM_NONE; ix = coremap[ix].cme_next) {
+		if (coremap[ix].cme_npages >= npages) {
+			return ix;
+		}
+	}
+	for (b++; b < CM_NBUCKETS; b++) {
+		if (cm_buckets[b] != CM_NONE) {
+			KASSERT(coremap[cm_buckets[b]].cme_npages >= npages);
+			return cm_buckets[b];
+		}
+	}
+	return CM_NONE;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned npages, mappages, i;
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	/* Carve the map itself out of the bottom of memory. */
+	npages = (hi - lo) / PAGE_SIZE;
+	mappages = DIVROUNDUP(npages * sizeof(struct cm_entry), PAGE_SIZE);
+	KASSERT(mappages < npages);
+
+	spinlock_acquire(&coremap_lock);
+
+	coremap = (struct cm_entry *)PADDR_TO_KVADDR(lo);
+	cm_base = lo + mappages * PAGE_SIZE;
+	cm_nframes = npages - mappages;
+
+	for (i=0; i<CM_NBUCKETS; i++) {
+		cm_buckets[i] = CM_NONE;
+	}
+	for (i=0; i<cm_nframes; i++) {
+		coremap[i].cme_flags = CME_FREE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_next = coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_refs = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_slot = COREMAP_NOSLOT;
+	}
+	cm_setfree(0, cm_nframes);
+	cm_hand = 0;
+	cm_nzeroed = cm_nzeroing = 0;
+	cm_nfree = cm_nframes;
+	cm_ready = true;
+
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %uk in %u pages (%u pages of map)\n",
+		cm_nframes * PAGE_SIZE / 1024, cm_nframes, mappages);
+}
+
+/*
+ * Set up the head entry of a newly allocated run.
+ */
+static
+void
+cm_sethead(uint32_t first, unsigned npages)
+{
+	coremap[first].cme_flags = CME_HEAD;
+	coremap[first].cme_npages = npages;
+	coremap[first].cme_refs = 1;
+	coremap[first].cme_as = NULL;
+	coremap[first].cme_vaddr = 0;
+	coremap[first].cme_slot = COREMAP_NOSLOT;
+	cm_nfree -= npages;
+}
+
+/*
+ * Take a page from the zeroed pool. Call with the coremap lock held.
+ */
+static
+uint32_t
+cm_takezeroed(void)
+{
+	uint32_t ix;
+
+	if (cm_nzeroed == 0) {
+		return CM_NONE;
+	}
+	ix = cm_zeroed[--cm_nzeroed];
+	KASSERT(coremap[ix].cme_flags == CME_ZEROED);
+	cm_sethead(ix, 1);
+	return ix;
+}
+
+/*
+ * Allocate a run of NPAGES frames from the free lists, returning the
+ * index of the first, or CM_NONE. Call with the coremap lock held.
+ */
+static
+uint32_t
+cm_allocrun(unsigned npages)
+{
+	uint32_t ix, first, i;
+	unsigned runlen;
+
+	ix = cm_findrun(npages);
+	if (ix == CM_NONE) {
+		return CM_NONE;
+	}
+
+	/* Take the pages off the top of the run; the rest stays free. */
+	runlen = coremap[ix].cme_npages;
+	cm_remove(ix);
+	if (runlen > npages) {
+		cm_setfree(ix, runlen - npages);
+	}
+	first = ix + runlen - npages;
+
+	for (i=first; i<first+npages; i++) {
+		KASSERT(coremap[i].cme_flags & CME_FREE);
+		coremap[i].cme_flags = 0;
+		coremap[i].cme_npages = 0;
+	}
+	cm_sethead(first, npages);
+	return first;
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	uint32_t first;
+	paddr_t pa;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (!cm_ready) {
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	first = cm_allocrun(npages);
+	if (first == CM_NONE && npages == 1) {
+		/* last resort */
+		first = cm_takezeroed();
+	}
+	spinlock_release(&coremap_lock);
+	if (first == CM_NONE) {
+		return 0;
+	}
+	return cm_base + first * PAGE_SIZE;
+}
+
+paddr_t
+coremap_allocz(void)
+{
+	uint32_t ix;
+
+	spinlock_acquire(&coremap_lock);
+	ix = cm_takezeroed();
+	spinlock_release(&coremap_lock);
+	if (ix == CM_NONE) {
+		return 0;
+	}
+	return cm_base + ix * PAGE_SIZE;
+}
+
+bool
+coremap_zerofill(void)
+{
+	uint32_t ix;
+
+	spinlock_acquire(&coremap_lock);
+	if (!cm_ready || cm_nzeroed + cm_nzeroing >= CM_ZEROPOOL) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	ix = cm_allocrun(1);
+	if (ix != CM_NONE) {
+		cm_nzeroing++;
+	}
+	spinlock_release(&coremap_lock);
+	if (ix == CM_NONE) {
+		return false;
+	}
+
+	bzero((void *)PADDR_TO_KVADDR(cm_base + ix * PAGE_SIZE), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	cm_nzeroing--;
+	KASSERT(cm_nzeroed < CM_ZEROPOOL);
+	coremap[ix].cme_flags = CME_ZEROED;
+	coremap[ix].cme_npages = 0;
+	cm_zeroed[cm_nzeroed++] = ix;
+	cm_nfree++;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	uint32_t ix, start, i;
+	unsigned npages, len;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (!cm_ready || paddr < cm_base) {
+		/* Stolen before bootstrap; we can't take it back. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	ix = (paddr - cm_base) / PAGE_SIZE;
+	KASSERT(ix < cm_nframes);
+	if ((coremap[ix].cme_flags & CME_HEAD) == 0) {
+		panic("coremap_free: 0x%x is not the start of a block\n",
+		      paddr);
+	}
+	npages = coremap[ix].cme_npages;
+	KASSERT(ix + npages <= cm_nframes);
+
+	KASSERT(coremap[ix].cme_refs > 0);
+	if (--coremap[ix].cme_refs > 0) {
+		/* still shared */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	for (i=ix; i<ix+npages; i++) {
+		coremap[i].cme_flags = CME_FREE;
+	}
+	cm_nfree += npages;
+
+	/* Merge with the free run below, if any... */
+	start = ix;
+	len = npages;
+	if (start > 0 && (coremap[start-1].cme_flags & CME_FREE)) {
+		len += coremap[start-1].cme_npages;
+		start -= coremap[start-1].cme_npages;
+		cm_remove(start);
+	}
+
+	/* ...and the one above. */
+	if (ix + npages < cm_nframes &&
+	    (coremap[ix + npages].cme_flags & CME_FREE)) {
+		len += coremap[ix + npages].cme_npages;
+		cm_remove(ix + npages);
+	}
+
+	cm_setfree(start, len);
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Look up the coremap entry for an allocated page. Call with the
+ * coremap lock held.
+ */
+static
+struct cm_entry *
+cm_getentry(paddr_t paddr)
+{
+	uint32_t ix;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(cm_ready && paddr >= cm_base);
+
+	ix = (paddr - cm_base) / PAGE_SIZE;
+	KASSERT(ix < cm_nframes);
+	KASSERT(coremap[ix].cme_flags & CME_HEAD);
+	return &coremap[ix];
+}
+
+void
+coremap_ref(paddr_t paddr)
+{
+	struct cm_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_getentry(paddr);
+	KASSERT(e->cme_refs > 0);
+	e->cme_refs++;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned refs;
+
+	spinlock_acquire(&coremap_lock);
+	refs = cm_getentry(paddr)->cme_refs;
+	spinlock_release(&coremap_lock);
+	return refs;
+}
+
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_getentry(paddr);
+	KASSERT(e->cme_npages == 1);
+	e->cme_as = as;
+	e->cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setslot(paddr_t paddr, unsigned slot)
+{
+	spinlock_acquire(&coremap_lock);
+	cm_getentry(paddr)->cme_slot = slot;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_getslot(paddr_t paddr)
+{
+	unsigned slot;
+
+	spinlock_acquire(&coremap_lock);
+	slot = cm_getentry(paddr)->cme_slot;
+	spinlock_release(&coremap_lock);
+	return slot;
+}
+
+/*
+ * Advance the clock hand to the next page that may be evicted: a
+ * single page with an owner that nobody else shares.
+ */
+paddr_t
+coremap_clock(struct addrspace **as, vaddr_t *vaddr)
+{
+	struct cm_entry *e;
+	unsigned n;
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n<cm_nframes; n++) {
+		e = &coremap[cm_hand];
+		if (++cm_hand == cm_nframes) {
+			cm_hand = 0;
+		}
+		if ((e->cme_flags & CME_HEAD) == 0 || e->cme_npages != 1 ||
+		    e->cme_as == NULL || e->cme_refs != 1) {
+			continue;
+		}
+		*as = e->cme_as;
+		*vaddr = e->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return cm_base + (e - coremap) * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+void
+coremap_getstats(unsigned *total, unsigned *nfree)
+{
+	spinlock_acquire(&coremap_lock);
+	*total = cm_nframes;
+	*nfree = cm_nfree;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Fragmentation report. Copies the free-run counts out under the lock
+ * and prints afterwards, since kprintf may sleep.
+ */
+void
+coremap_printstats(void)
+{
+	unsigned nruns[CM_NBUCKETS], npages[CM_NBUCKETS];
+	unsigned total, nfree, nzeroed, largest, b;
+	uint32_t ix;
+
+	spinlock_acquire(&coremap_lock);
+	total = cm_nframes;
+	nfree = cm_nfree;
+	nzeroed = cm_nzeroed;
+	largest = 0;
+	for (b=0; b<CM_NBUCKETS; b++) {
+		nruns[b] = npages[b] = 0;
+		for (ix = cm_buckets[b]; ix != CM_NONE;
+		     ix = coremap[ix].cme_next) {
+			nruns[b]++;
+			npages[b] += coremap[ix].cme_npages;
+			if (coremap[ix].cme_npages > largest) {
+				largest = coremap[ix].cme_npages;
+			}
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("Physical memory: %u of %u pages free (%u zeroed), "
+		"largest free run %u pages\n", nfree, total, nzeroed, largest);
+	for (b=0; b<CM_NBUCKETS; b++) {
+		if (nruns[b] == 0) {
+			continue;
+		}
+		kprintf("   runs of %u-%u pages: %u (%u pages)\n",
+			1U << b, (2U << b) - 1, nruns[b], npages[b]);
+	}
+	if (nfree > 0) {
+		/* 0% when all free memory is one run */
+		kprintf("   fragmentation: %u%%\n",
+			(nfree - largest) * 100 / nfree);
+	}
+}
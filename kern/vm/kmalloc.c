@@ -29,8 +29,13 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
+#include <objcache.h>
 
 /*
  * Kernel malloc.
@@ -61,6 +66,12 @@ fill_deadbeef(void *vptr, size_t len)
 //    freecount, so we know when the page is completely free and can 
 //    release it.
 //
+//    For the sizes between 2K and a page, a single page would hold
+//    only one block and waste the rest, so those sizes use a "chunk"
+//    of a few contiguous pages instead, chosen so the blocks fill it
+//    exactly. Everywhere below, "page" in the context of a pageref
+//    means the whole chunk.
+//
 //    No assumptions are made about the sizes k; they need not be
 //    powers of two. Note, however, that malloc must always return
 //    pointers aligned to the maximum alignment requirements of the
@@ -83,11 +94,14 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define NSIZES 11
+static const size_t sizes[NSIZES] =
+	{ 16, 32, 64, 128, 256, 512, 1024, 2048, 2560, 3072, 3584 };
+static const unsigned chunkpages[NSIZES] =
+	{ 1,  1,  1,  1,   1,   1,   1,    1,    5,    3,    7 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SUBPAGE_SIZE 3584
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -103,7 +117,9 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref **prev_samesize;	/* NULL if not on a size list */
 	struct pageref *next_all;
+	struct pageref **prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -111,6 +127,9 @@ struct pageref {
 
 #define INVALID_OFFSET   (0xffff)
 
+#define CHUNK_SIZE(blk)       (chunkpages[blk] * PAGE_SIZE)
+#define BLOCKS_PER_CHUNK(blk) (CHUNK_SIZE(blk) / sizes[blk])
+
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
@@ -118,84 +137,250 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * sizebases[] holds, for each block size, the pages that have at least
+ * one free block; full pages are taken off and put back when a block
+ * is freed on them, so kmalloc never has to search. allbase holds every
+ * page. Both lists are doubly linked so a page can be taken off either
+ * in constant time.
+ */
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
+
+////////////////////////////////////////
+
+/*
+ * One spinlock covers the page lists, the pageref pool, and the page
+ * directory. Most kmalloc and kfree calls never get here, because the
+ * per-cpu magazines further down take care of them.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+//
+// Pageref pool.
+//
+// Pagerefs are carved out of whole pages as needed, so the size of
+// the heap is limited only by memory. Pages of pagerefs are never
+// given back; free pagerefs sit on freepagerefs, linked by next_all.
+//
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+#define PAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+
+static struct pageref *freepagerefs;
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
-	}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	if (pr != NULL) {
+		freepagerefs = pr->next_all;
+	}
+	return pr;
 }
 
 static
 void
-freepageref(struct pageref *p)
+freepageref(struct pageref *pr)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pr->next_all = freepagerefs;
+	freepagerefs = pr;
+}
+
+/*
+ * Get another page of pagerefs. Call without the spinlock.
+ */
+static
+bool
+morepagerefs(void)
+{
+	struct pageref *prs;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return false;
+	}
+	prs = (struct pageref *)page;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<PAGEREFS_PER_PAGE; i++) {
+		freepageref(&prs[i]);
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	return true;
 }
 
 ////////////////////////////////////////
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+static
+void
+samesize_insert(struct pageref *pr, int blktype)
+{
+	KASSERT(pr->prev_samesize == NULL);
+
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
+	}
+	pr->prev_samesize = &sizebases[blktype];
+	sizebases[blktype] = pr;
+}
+
+static
+void
+samesize_remove(struct pageref *pr)
+{
+	KASSERT(pr->prev_samesize != NULL);
+
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = NULL;
+	pr->prev_samesize = NULL;
+}
+
+static
+void
+all_insert(struct pageref *pr)
+{
+	pr->next_all = allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = &pr->next_all;
+	}
+	pr->prev_all = &allbase;
+	allbase = pr;
+}
+
+static
+void
+all_remove(struct pageref *pr)
+{
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
+	}
+	pr->next_all = NULL;
+	pr->prev_all = NULL;
+}
 
 ////////////////////////////////////////
+//
+// Page directory.
+//
+// Maps each page of the subpage allocator to its pageref, through a
+// two-level table indexed by physical page number. This is how kfree
+// finds the block size of a pointer without taking kmalloc_spinlock.
+//
+// Leaf tables are allocated as the heap grows and never freed. An
+// entry is set when its page goes into service and cleared, with
+// kmalloc_spinlock held, before the page is released; so a lookup
+// made on a pointer the caller legitimately owns is always stable.
+//
+
+#define PRDIR_LEAFSIZE (PAGE_SIZE / sizeof(struct pageref *))
+#define PRDIR_SIZE     1024	/* leaves to cover 4G of physical memory */
+
+static struct pageref **prdir[PRDIR_SIZE];
+
+static
+struct pageref *
+prdir_lookup(vaddr_t addr)
+{
+	unsigned pagenum;
+	struct pageref **leaf;
+
+	pagenum = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	leaf = prdir[pagenum / PRDIR_LEAFSIZE];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return leaf[pagenum % PRDIR_LEAFSIZE];
+}
+
+/*
+ * Make sure the leaves covering the NPAGES pages starting at ADDR
+ * exist. Call without the spinlock, since it may need to allocate
+ * pages. A chunk spans at most two leaves; all the missing ones are
+ * allocated before any is installed, so on failure nothing is left
+ * behind.
+ */
+static
+bool
+prdir_prepare(vaddr_t addr, unsigned npages)
+{
+	unsigned first, last, ix;
+	vaddr_t leaves[2];
+
+	KASSERT(npages > 0);
+	first = (KVADDR_TO_PADDR(addr) / PAGE_SIZE) / PRDIR_LEAFSIZE;
+	last = (KVADDR_TO_PADDR(addr) / PAGE_SIZE + npages - 1)
+		/ PRDIR_LEAFSIZE;
+	KASSERT(last < PRDIR_SIZE);
+	KASSERT(last - first < 2);
+
+	for (ix = first; ix <= last; ix++) {
+		leaves[ix - first] = 0;
+		if (prdir[ix] != NULL) {
+			continue;
+		}
+		leaves[ix - first] = alloc_kpages(1);
+		if (leaves[ix - first] == 0) {
+			while (ix-- > first) {
+				if (leaves[ix - first] != 0) {
+					free_kpages(leaves[ix - first]);
+				}
+			}
+			return false;
+		}
+		bzero((void *)leaves[ix - first], PAGE_SIZE);
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (ix = first; ix <= last; ix++) {
+		if (leaves[ix - first] != 0 && prdir[ix] == NULL) {
+			prdir[ix] = (struct pageref **)leaves[ix - first];
+			leaves[ix - first] = 0;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	for (ix = first; ix <= last; ix++) {
+		if (leaves[ix - first] != 0) {
+			/* someone else got there first */
+			free_kpages(leaves[ix - first]);
+		}
+	}
+	return true;
+}
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Point the entries for the NPAGES pages starting at ADDR to PR.
  */
+static
+void
+prdir_set(vaddr_t addr, unsigned npages, struct pageref *pr)
+{
+	unsigned pagenum, i;
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	pagenum = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	for (i=pagenum; i<pagenum+npages; i++) {
+		KASSERT(prdir[i / PRDIR_LEAFSIZE] != NULL);
+		prdir[i / PRDIR_LEAFSIZE][i % PRDIR_LEAFSIZE] = pr;
+	}
+}
 
 ////////////////////////////////////////
 
@@ -226,7 +411,7 @@ checksubpage(struct pageref *pr)
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < CHUNK_SIZE(blktype));
 	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -234,7 +419,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + CHUNK_SIZE(blktype));
 		KASSERT((fla-prpage) % sizes[blktype] == 0);
 		KASSERT(fla >= MIPS_KSEG0);
 		KASSERT(fla < MIPS_KSEG1);
@@ -260,15 +445,19 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(*pr->prev_samesize == pr);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+		KASSERT(*pr->prev_all == pr);
+		KASSERT(prdir_lookup(PR_PAGEADDR(pr)) == pr);
+		if (pr->nfree > 0) {
+			ac++;
+		}
 	}
 
 	KASSERT(sc==ac);
@@ -301,7 +490,7 @@ dumpsubpage(struct pageref *pr)
 	blktype = PR_BLOCKTYPE(pr);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = BLOCKS_PER_CHUNK(blktype);
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -330,50 +519,8 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
-void
-kheap_printstats(void)
-{
-	struct pageref *pr;
-
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
-
-	kprintf("Subpage allocator status:\n");
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
-	}
-
-	spinlock_release(&kmalloc_spinlock);
-}
-
 ////////////////////////////////////////
 
-static
-void
-remove_lists(struct pageref *pr, int blktype)
-{
-	struct pageref **guy;
-
-	KASSERT(blktype>=0 && blktype<NSIZES);
-
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
-	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
-	}
-}
-
 static
 inline
 int blocktype(size_t sz)
@@ -403,7 +550,7 @@ subpage_kmalloc(size_t sz)
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	volatile unsigned i;
 
 
 	blktype = blocktype(sz);
@@ -413,41 +560,42 @@ subpage_kmalloc(size_t sz)
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	pr = sizebases[blktype];
+	if (pr != NULL) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
+	doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+		KASSERT(pr->nfree > 0);
+		KASSERT(pr->freelist_offset < CHUNK_SIZE(blktype));
+		prpage = PR_PAGEADDR(pr);
+		fla = prpage + pr->freelist_offset;
+		fl = (struct freelist *)fla;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+		retptr = fl;
+		fl = fl->next;
+		pr->nfree--;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		if (fl != NULL) {
+			KASSERT(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			KASSERT(fla - prpage < CHUNK_SIZE(blktype));
+			pr->freelist_offset = fla - prpage;
+		}
+		else {
+			/* Page is now full; take it off the size list. */
+			KASSERT(pr->nfree == 0);
+			pr->freelist_offset = INVALID_OFFSET;
+			samesize_remove(pr);
+		}
 
-			checksubpages();
+		checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -460,25 +608,35 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	prpage = alloc_kpages(chunkpages[blktype]);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
+	if (!prdir_prepare(prpage, chunkpages[blktype])) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't get a "
+			"page directory\n");
+		return NULL;
+	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		if (!morepagerefs()) {
+			/* No accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = BLOCKS_PER_CHUNK(blktype);
+	prdir_set(prpage, chunkpages[blktype], pr);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -498,11 +656,9 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
-
-	pr->next_all = allbase;
-	allbase = pr;
+	pr->prev_samesize = NULL;
+	samesize_insert(pr, blktype);
+	all_insert(pr);
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
@@ -526,38 +682,27 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = prdir_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= CHUNK_SIZE(blktype) || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
-
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
@@ -572,11 +717,17 @@ subpage_kfree(void *ptr)
 	}
 	pr->freelist_offset = offset;
 	pr->nfree++;
+	if (pr->nfree == 1) {
+		/* Page was full; it has room again. */
+		samesize_insert(pr, blktype);
+	}
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+	KASSERT(pr->nfree <= BLOCKS_PER_CHUNK(blktype));
+	if (pr->nfree == BLOCKS_PER_CHUNK(blktype)) {
 		/* Whole page is free. */
-		remove_lists(pr, blktype);
+		prdir_set(prpage, chunkpages[blktype], NULL);
+		samesize_remove(pr);
+		all_remove(pr);
 		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
@@ -598,14 +749,391 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// A magazine is a small stack of free blocks of one size. Each cpu
+// keeps two magazines per block size, a loaded one and the previous
+// one, and serves kmalloc and kfree from them with interrupts off and
+// no lock held. Only when both are empty (on kmalloc) or both are full
+// (on kfree) does it go to the depot, under depot_spinlock, to trade a
+// whole magazine for a full or empty one. Everything else falls
+// through to the subpage allocator.
+//
+// Magazines hold fewer rounds for the larger block sizes, and the
+// depot keeps only a few full magazines per size, to bound how much
+// memory can sit idle in them. If the subpage allocator runs out of
+// pages, the depot's full magazines are drained back into it.
+//
+
+#define MAG_ROUNDS	14	/* makes struct magazine 64 bytes */
+#define DEPOT_MAXFULL	4	/* full magazines kept per block size */
+
+struct magazine {
+	struct magazine *mag_next;	/* depot list link */
+	unsigned mag_nrounds;		/* number of blocks held */
+	void *mag_rounds[MAG_ROUNDS];
+};
+
+struct kmalloc_cpu {
+	struct magazine *kc_loaded[NSIZES];
+	struct magazine *kc_previous[NSIZES];
+};
+
+struct depot {
+	struct magazine *d_full;
+	struct magazine *d_empty;
+	unsigned d_nfull;
+	unsigned d_nempty;
+};
+
+static struct depot depots[NSIZES];
+static struct spinlock depot_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Capacity of a magazine for block type BLKTYPE: about a chunk's worth
+ * of blocks, but at least 2 and at most MAG_ROUNDS.
+ */
+static
+unsigned
+magcapacity(int blktype)
+{
+	unsigned n;
+
+	n = BLOCKS_PER_CHUNK(blktype);
+	if (n < 2) {
+		n = 2;
+	}
+	if (n > MAG_ROUNDS) {
+		n = MAG_ROUNDS;
+	}
+	return n;
+}
+
+/*
+ * Take a full magazine from the depot, leaving EMPTY (if any) in its
+ * place. Returns NULL, and leaves EMPTY with the caller, if there are
+ * no full magazines.
+ */
+static
+struct magazine *
+depot_getfull(int blktype, struct magazine *empty)
+{
+	struct depot *d = &depots[blktype];
+	struct magazine *mag;
+
+	spinlock_acquire(&depot_spinlock);
+	mag = d->d_full;
+	if (mag != NULL) {
+		d->d_full = mag->mag_next;
+		d->d_nfull--;
+		if (empty != NULL) {
+			KASSERT(empty->mag_nrounds == 0);
+			empty->mag_next = d->d_empty;
+			d->d_empty = empty;
+			d->d_nempty++;
+		}
+	}
+	spinlock_release(&depot_spinlock);
+	return mag;
+}
+
+/*
+ * Take an empty magazine from the depot, leaving FULL (if any) in its
+ * place. Fails if there are no empty magazines or if the depot already
+ * holds as many full ones as it is allowed to.
+ */
+static
+struct magazine *
+depot_getempty(int blktype, struct magazine *full)
+{
+	struct depot *d = &depots[blktype];
+	struct magazine *mag;
+
+	spinlock_acquire(&depot_spinlock);
+	mag = d->d_empty;
+	if (mag != NULL && (full == NULL || d->d_nfull < DEPOT_MAXFULL)) {
+		d->d_empty = mag->mag_next;
+		d->d_nempty--;
+		if (full != NULL) {
+			full->mag_next = d->d_full;
+			d->d_full = full;
+			d->d_nfull++;
+		}
+	}
+	else {
+		mag = NULL;
+	}
+	spinlock_release(&depot_spinlock);
+	return mag;
+}
+
+/*
+ * Allocate a block of type BLKTYPE from this cpu's magazines. Returns
+ * NULL if neither they nor the depot have one.
+ */
+static
+void *
+magazine_kmalloc(int blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	void *ptr = NULL;
+	int spl;
+
+	spl = splhigh();
+	if (!CURCPU_EXISTS() || curcpu->c_kmalloc == NULL) {
+		splx(spl);
+		return NULL;
+	}
+	kc = curcpu->c_kmalloc;
+
+	while (1) {
+		mag = kc->kc_loaded[blktype];
+		if (mag != NULL && mag->mag_nrounds > 0) {
+			ptr = mag->mag_rounds[--mag->mag_nrounds];
+			break;
+		}
+
+		mag = kc->kc_previous[blktype];
+		if (mag != NULL && mag->mag_nrounds > 0) {
+			kc->kc_previous[blktype] = kc->kc_loaded[blktype];
+			kc->kc_loaded[blktype] = mag;
+			continue;
+		}
+
+		/* Both empty; trade the previous one in for a full one. */
+		mag = depot_getfull(blktype, kc->kc_previous[blktype]);
+		if (mag == NULL) {
+			break;
+		}
+		kc->kc_previous[blktype] = kc->kc_loaded[blktype];
+		kc->kc_loaded[blktype] = mag;
+	}
+
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Free a block of type BLKTYPE into this cpu's magazines. Returns
+ * false if it has to go back to the subpage allocator instead.
+ */
+static
+bool
+magazine_kfree(void *ptr, int blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	unsigned cap;
+	int spl;
+
+	cap = magcapacity(blktype);
+
+	spl = splhigh();
+	while (1) {
+		if (!CURCPU_EXISTS() || curcpu->c_kmalloc == NULL) {
+			splx(spl);
+			return false;
+		}
+		kc = curcpu->c_kmalloc;
+
+		mag = kc->kc_loaded[blktype];
+		if (mag != NULL && mag->mag_nrounds < cap) {
+			mag->mag_rounds[mag->mag_nrounds++] = ptr;
+			splx(spl);
+			return true;
+		}
+
+		mag = kc->kc_previous[blktype];
+		if (mag != NULL && mag->mag_nrounds < cap) {
+			kc->kc_previous[blktype] = kc->kc_loaded[blktype];
+			kc->kc_loaded[blktype] = mag;
+			continue;
+		}
+
+		/* Both full; trade the previous one in for an empty one. */
+		mag = depot_getempty(blktype, kc->kc_previous[blktype]);
+		if (mag != NULL) {
+			kc->kc_previous[blktype] = kc->kc_loaded[blktype];
+			kc->kc_loaded[blktype] = mag;
+			continue;
+		}
+		if (depots[blktype].d_nfull >= DEPOT_MAXFULL) {
+			splx(spl);
+			return false;
+		}
+
+		/*
+		 * No empty magazines around; make one and try again.
+		 * We may come back on a different cpu.
+		 */
+		splx(spl);
+		mag = subpage_kmalloc(sizeof(struct magazine));
+		if (mag == NULL) {
+			return false;
+		}
+		mag->mag_nrounds = 0;
+
+		spinlock_acquire(&depot_spinlock);
+		mag->mag_next = depots[blktype].d_empty;
+		depots[blktype].d_empty = mag;
+		depots[blktype].d_nempty++;
+		spinlock_release(&depot_spinlock);
+
+		spl = splhigh();
+	}
+}
+
+/*
+ * Give everything in the depot back to the subpage allocator. Used
+ * when it runs out of pages. Returns the number of blocks freed.
+ */
+static
+unsigned
+depot_reclaim(void)
+{
+	struct magazine *full[NSIZES], *empty[NSIZES], *mag;
+	unsigned i, n = 0;
+
+	spinlock_acquire(&depot_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		full[i] = depots[i].d_full;
+		empty[i] = depots[i].d_empty;
+		depots[i].d_full = depots[i].d_empty = NULL;
+		depots[i].d_nfull = depots[i].d_nempty = 0;
+	}
+	spinlock_release(&depot_spinlock);
+
+	for (i=0; i<NSIZES; i++) {
+		while (full[i] != NULL) {
+			mag = full[i];
+			full[i] = mag->mag_next;
+			while (mag->mag_nrounds > 0) {
+				subpage_kfree(mag->mag_rounds[--mag->mag_nrounds]);
+				n++;
+			}
+			subpage_kfree(mag);
+		}
+		while (empty[i] != NULL) {
+			mag = empty[i];
+			empty[i] = mag->mag_next;
+			subpage_kfree(mag);
+		}
+	}
+	return n;
+}
+
+/*
+ * Set up the per-cpu state for a new cpu. Called by cpu_create. If
+ * this fails, the cpu just goes without magazines.
+ */
+struct kmalloc_cpu *
+kmalloc_cpu_create(void)
+{
+	struct kmalloc_cpu *kc;
+	unsigned i;
+
+	kc = subpage_kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_loaded[i] = NULL;
+		kc->kc_previous[i] = NULL;
+	}
+	return kc;
+}
+
+void
+kheap_printstats(void)
+{
+	struct pageref *pr;
+	unsigned nfull[NSIZES], nempty[NSIZES];
+	unsigned nchunks[NSIZES], nfree[NSIZES];
+	unsigned long used, held;
+	int i;
+
+	for (i=0; i<NSIZES; i++) {
+		nchunks[i] = nfree[i] = 0;
+	}
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kprintf("Subpage allocator status:\n");
+
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		dumpsubpage(pr);
+		nchunks[PR_BLOCKTYPE(pr)]++;
+		nfree[PR_BLOCKTYPE(pr)] += pr->nfree;
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+
+	/*
+	 * Blocks sitting in magazines count as used here; the
+	 * magazine report below says how many of those there are.
+	 */
+	kprintf("Subpage usage:\n");
+	used = held = 0;
+	for (i=0; i<NSIZES; i++) {
+		if (nchunks[i] == 0) {
+			continue;
+		}
+		kprintf("   size %-4lu  %u chunks of %u pages, "
+			"%u/%u blocks used\n",
+			(unsigned long)sizes[i], nchunks[i], chunkpages[i],
+			nchunks[i] * BLOCKS_PER_CHUNK(i) - nfree[i],
+			nchunks[i] * BLOCKS_PER_CHUNK(i));
+		used += (nchunks[i] * BLOCKS_PER_CHUNK(i) - nfree[i])
+			* sizes[i];
+		held += nchunks[i] * CHUNK_SIZE(i);
+	}
+	kprintf("   %lu of %lu bytes used (%lu%%)\n", used, held,
+		held ? used * 100 / held : 0);
+
+	kprintf("Magazine depot:\n");
+	spinlock_acquire(&depot_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		nfull[i] = depots[i].d_nfull;
+		nempty[i] = depots[i].d_nempty;
+	}
+	spinlock_release(&depot_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		kprintf("   size %-4lu  %u full, %u empty (%u rounds each)\n",
+			(unsigned long)sizes[i], nfull[i], nempty[i],
+			magcapacity(i));
+	}
+
+	objcache_printstats();
+	coremap_printstats();
+}
+
+void
+kheap_printlockstats(void)
+{
+	spinlock_printstats(&kmalloc_spinlock, "kmalloc_spinlock");
+	spinlock_printstats(&depot_spinlock, "depot_spinlock");
+}
+
+//
+////////////////////////////////////////////////////////////
+
 void *
 kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
+	void *ptr;
+
+	if (sz>LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+		/*
+		 * Round up to a whole number of pages. The coremap hands
+		 * out contiguous runs and merges them back on free.
+		 */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
@@ -615,20 +1143,55 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	ptr = magazine_kmalloc(blocktype(sz));
+	if (ptr != NULL) {
+		return ptr;
+	}
+
+	ptr = subpage_kmalloc(sz);
+	if (ptr == NULL && depot_reclaim() > 0) {
+		ptr = subpage_kmalloc(sz);
+	}
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	struct pageref *pr;
+	vaddr_t ptraddr;
+	int blktype;
+
+	if (ptr == NULL) {
+		return;
+	}
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * If it's not on one of the subpage allocator's pages, it's a
+	 * big allocation.
 	 */
-	if (ptr == NULL) {
+	ptraddr = (vaddr_t)ptr;
+	pr = prdir_lookup(ptraddr);
+	if (pr == NULL) {
+		KASSERT(ptraddr%PAGE_SIZE==0);
+		free_kpages(ptraddr);
 		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+	}
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	if ((ptraddr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	if (!magazine_kfree(ptr, blktype)) {
+		subpage_kfree(ptr);
 	}
 }
 
@@ -0,0 +1,341 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+/*
+ * Object caches (see objcache.h).
+ *
+ * Each slab is one page. The struct slab header sits at the start of
+ * the page, so the slab for an object is found by masking its address.
+ * After the header come a stack of free object indexes and a byte per
+ * object recording whether it has been constructed; the objects fill
+ * the rest of the page.
+ *
+ * Slabs with some objects in use are on oc_partial. Slabs with none
+ * are on oc_empty, up to OBJCACHE_MAXEMPTY of them; beyond that an
+ * empty slab's objects are destroyed and the page is given back. Full
+ * slabs are on no list until an object on them is put back.
+ */
+
+#define OBJCACHE_MAXEMPTY  1	/* empty slabs kept per cache */
+#define OBJCACHE_ALIGN     8	/* alignment of objects */
+
+struct slab {
+	struct slab *sl_next;
+	struct slab **sl_prev;		/* NULL if on no list */
+	struct objcache *sl_cache;	/* owning cache, for sanity checks */
+	vaddr_t sl_objs;		/* address of object 0 */
+	uint16_t sl_nobjs;		/* objects in this slab */
+	uint16_t sl_nfree;		/* entries in sl_free */
+	uint16_t sl_free[];		/* stack of free object indexes */
+	/* followed by uint8_t constructed[sl_nobjs] */
+};
+
+#define SLAB_BUILT(sl) ((uint8_t *)&(sl)->sl_free[(sl)->sl_nobjs])
+
+/* List of all caches that have ever had a slab, for objcache_printstats. */
+static struct objcache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+
+static
+size_t
+objcache_objsize(struct objcache *oc)
+{
+	return ROUNDUP(oc->oc_size, OBJCACHE_ALIGN);
+}
+
+static
+unsigned
+objcache_perslab(struct objcache *oc)
+{
+	size_t per;
+
+	/* each object costs its size, a free-stack slot, and a byte */
+	per = objcache_objsize(oc) + sizeof(uint16_t) + sizeof(uint8_t);
+	return (PAGE_SIZE - sizeof(struct slab) - OBJCACHE_ALIGN) / per;
+}
+
+static
+void
+slab_insert(struct slab **head, struct slab *sl)
+{
+	KASSERT(sl->sl_prev == NULL);
+
+	sl->sl_next = *head;
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = &sl->sl_next;
+	}
+	sl->sl_prev = head;
+	*head = sl;
+}
+
+static
+void
+slab_remove(struct slab *sl)
+{
+	KASSERT(sl->sl_prev != NULL);
+
+	*sl->sl_prev = sl->sl_next;
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = NULL;
+	sl->sl_prev = NULL;
+}
+
+/*
+ * Get a fresh page and lay out a slab in it. Called without the cache
+ * lock; the slab is not on any list yet.
+ */
+static
+struct slab *
+slab_create(struct objcache *oc)
+{
+	struct slab *sl;
+	vaddr_t page;
+	unsigned n, i;
+
+	n = objcache_perslab(oc);
+	KASSERT(n > 0);
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	sl = (struct slab *)page;
+	sl->sl_next = NULL;
+	sl->sl_prev = NULL;
+	sl->sl_cache = oc;
+	sl->sl_nobjs = n;
+	sl->sl_nfree = n;
+	for (i=0; i<n; i++) {
+		/* hand out low addresses first */
+		sl->sl_free[i] = n - 1 - i;
+	}
+	bzero(SLAB_BUILT(sl), n);
+	sl->sl_objs = ROUNDUP((vaddr_t)&SLAB_BUILT(sl)[n], OBJCACHE_ALIGN);
+	KASSERT(sl->sl_objs + n * objcache_objsize(oc) <= page + PAGE_SIZE);
+
+	if (!oc->oc_listed) {
+		spinlock_acquire(&allcaches_lock);
+		if (!oc->oc_listed) {
+			oc->oc_next = allcaches;
+			allcaches = oc;
+			oc->oc_listed = true;
+		}
+		spinlock_release(&allcaches_lock);
+	}
+
+	return sl;
+}
+
+/*
+ * Destroy the constructed objects in an empty slab and give back its
+ * page. Called without the cache lock.
+ */
+static
+void
+slab_destroy(struct objcache *oc, struct slab *sl)
+{
+	uint8_t *built;
+	size_t objsize;
+	unsigned i, ndtors = 0;
+
+	KASSERT(sl->sl_nfree == sl->sl_nobjs);
+
+	built = SLAB_BUILT(sl);
+	objsize = objcache_objsize(oc);
+	for (i=0; i<sl->sl_nobjs; i++) {
+		if (built[i] && oc->oc_dtor != NULL) {
+			oc->oc_dtor((void *)(sl->sl_objs + i * objsize));
+			ndtors++;
+		}
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_dtors += ndtors;
+	spinlock_release(&oc->oc_lock);
+
+	free_kpages((vaddr_t)sl);
+}
+
+/*
+ * Put object IX back on slab SL. BUILT says whether it is in the
+ * constructed state.
+ */
+static
+void
+objcache_release(struct objcache *oc, struct slab *sl, unsigned ix,
+		 bool built)
+{
+	spinlock_acquire(&oc->oc_lock);
+
+	KASSERT(sl->sl_nfree < sl->sl_nobjs);
+	KASSERT(oc->oc_inuse > 0);
+
+	if (sl->sl_nfree == 0) {
+		/* was full */
+		slab_insert(&oc->oc_partial, sl);
+	}
+	SLAB_BUILT(sl)[ix] = built;
+	sl->sl_free[sl->sl_nfree++] = ix;
+	oc->oc_inuse--;
+
+	if (sl->sl_nfree < sl->sl_nobjs) {
+		sl = NULL;
+	}
+	else {
+		slab_remove(sl);
+		if (oc->oc_nempty < OBJCACHE_MAXEMPTY) {
+			slab_insert(&oc->oc_empty, sl);
+			oc->oc_nempty++;
+			sl = NULL;
+		}
+		else {
+			oc->oc_nslabs--;
+		}
+	}
+
+	spinlock_release(&oc->oc_lock);
+
+	if (sl != NULL) {
+		slab_destroy(oc, sl);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+void *
+objcache_get(struct objcache *oc)
+{
+	struct slab *sl;
+	unsigned ix;
+	bool built;
+	void *obj;
+	int result;
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_gets++;
+
+	while (oc->oc_partial == NULL && oc->oc_empty == NULL) {
+		spinlock_release(&oc->oc_lock);
+		sl = slab_create(oc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		slab_insert(&oc->oc_empty, sl);
+		oc->oc_nempty++;
+		oc->oc_nslabs++;
+	}
+
+	/* Prefer slabs already in use, to let empty ones go. */
+	sl = oc->oc_partial;
+	if (sl == NULL) {
+		sl = oc->oc_empty;
+		slab_remove(sl);
+		oc->oc_nempty--;
+		slab_insert(&oc->oc_partial, sl);
+	}
+
+	KASSERT(sl->sl_cache == oc);
+	KASSERT(sl->sl_nfree > 0);
+	ix = sl->sl_free[--sl->sl_nfree];
+	if (sl->sl_nfree == 0) {
+		/* now full */
+		slab_remove(sl);
+	}
+	built = SLAB_BUILT(sl)[ix];
+	oc->oc_inuse++;
+	if (built) {
+		oc->oc_hits++;
+	}
+	else if (oc->oc_ctor != NULL) {
+		oc->oc_ctors++;
+	}
+
+	spinlock_release(&oc->oc_lock);
+
+	obj = (void *)(sl->sl_objs + ix * objcache_objsize(oc));
+	if (!built && oc->oc_ctor != NULL) {
+		result = oc->oc_ctor(obj);
+		if (result) {
+			objcache_release(oc, sl, ix, false);
+			return NULL;
+		}
+	}
+	return obj;
+}
+
+/*
+ * Common code for objcache_put and objcache_discard.
+ */
+static
+void
+objcache_return(struct objcache *oc, void *obj, bool built)
+{
+	struct slab *sl;
+	vaddr_t addr;
+	size_t objsize;
+
+	addr = (vaddr_t)obj;
+	sl = (struct slab *)(addr & PAGE_FRAME);
+	objsize = objcache_objsize(oc);
+
+	KASSERT(sl->sl_cache == oc);
+	KASSERT(addr >= sl->sl_objs);
+	if ((addr - sl->sl_objs) % objsize != 0) {
+		panic("objcache: %s: invalid object %p\n",
+		      oc->oc_name, obj);
+	}
+
+	objcache_release(oc, sl, (addr - sl->sl_objs) / objsize, built);
+}
+
+void
+objcache_put(struct objcache *oc, void *obj)
+{
+	objcache_return(oc, obj, true);
+}
+
+void
+objcache_discard(struct objcache *oc, void *obj)
+{
+	objcache_return(oc, obj, false);
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	unsigned inuse, nslabs, gets, hits, ctors, dtors;
+
+	spinlock_acquire(&allcaches_lock);
+	oc = allcaches;
+	spinlock_release(&allcaches_lock);
+
+	/* Caches are never taken off the list, so we can walk it unlocked. */
+	kprintf("Object caches:\n");
+	for (; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		inuse = oc->oc_inuse;
+		nslabs = oc->oc_nslabs;
+		gets = oc->oc_gets;
+		hits = oc->oc_hits;
+		ctors = oc->oc_ctors;
+		dtors = oc->oc_dtors;
+		spinlock_release(&oc->oc_lock);
+
+		kprintf("   %-12s %4lu bytes  %u in use, %u slabs of %u\n",
+			oc->oc_name, (unsigned long)oc->oc_size,
+			inuse, nslabs, objcache_perslab(oc));
+		kprintf("   %12s %u gets, %u%% hits, %u ctors, %u dtors\n",
+			"", gets, gets ? hits * 100 / gets : 0,
+			ctors, dtors);
+	}
+}
@@ -0,0 +1,135 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <pagetable.h>
+
+/*
+ * Page tables (see pagetable.h).
+ */
+
+static struct spinlock pt_spinlock = SPINLOCK_INITIALIZER;
+static struct wchan *pt_busywchan;	/* waiting for a busy page */
+
+void
+pt_bootstrap(void)
+{
+	pt_busywchan = wchan_create("ptbusy");
+	if (pt_busywchan == NULL) {
+		panic("pt_bootstrap: Out of memory\n");
+	}
+}
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_DIRSIZE; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_DIRSIZE; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			free_kpages((vaddr_t)pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	unsigned dirix;
+	vaddr_t leaf;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	dirix = vaddr / PT_LEAFSPAN;
+	if (pt->pt_dir[dirix] == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		/* Allocating may evict, which takes the lock. */
+		KASSERT(!spinlock_do_i_hold(&pt_spinlock));
+		leaf = alloc_kpages(1);
+		if (leaf == 0) {
+			return NULL;
+		}
+		bzero((void *)leaf, PAGE_SIZE);
+		pt_lock();
+		pt->pt_dir[dirix] = (pte_t *)leaf;
+		pt_unlock();
+	}
+	return &pt->pt_dir[dirix][(vaddr % PT_LEAFSPAN) / PAGE_SIZE];
+}
+
+int
+pt_foreach(struct pagetable *pt,
+	   int (*func)(vaddr_t vaddr, pte_t *pte, void *data),
+	   void *data)
+{
+	unsigned i, j;
+	pte_t *leaf;
+	int result;
+
+	for (i=0; i<PT_DIRSIZE; i++) {
+		leaf = pt->pt_dir[i];
+		if (leaf == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_LEAFSIZE; j++) {
+			if (leaf[j] == 0) {
+				continue;
+			}
+			result = func(i * PT_LEAFSPAN + j * PAGE_SIZE,
+				      &leaf[j], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+void
+pt_lock(void)
+{
+	spinlock_acquire(&pt_spinlock);
+}
+
+void
+pt_unlock(void)
+{
+	spinlock_release(&pt_spinlock);
+}
+
+void
+pt_waitbusy(void)
+{
+	/* Lock the channel first, so a wakeup can't slip past. */
+	wchan_lock(pt_busywchan);
+	spinlock_release(&pt_spinlock);
+	wchan_sleep(pt_busywchan);
+	spinlock_acquire(&pt_spinlock);
+}
+
+void
+pt_wakebusy(void)
+{
+	KASSERT(spinlock_do_i_hold(&pt_spinlock));
+	wchan_wakeall(pt_busywchan);
+}
@@ -0,0 +1,727 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <machine/vmtlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+/*
+ * Swapping (see swap.h).
+ *
+ * Slot N of the swap area is the page at offset N * PAGE_SIZE on the
+ * swap device. A slot belongs either to a swapped-out page, whose PTE
+ * names it, or to a resident page read back from it and not written
+ * since, whose coremap entry names it.
+ */
+
+/*
+ * How many pages swap_getpages will evict per page asked for before
+ * giving up; evicting single pages only frees a contiguous run by
+ * luck.
+ */
+#define SWAP_EVICTTRIES  4
+
+/* Pages evicted, and read ahead on swap-in, per request to the disk */
+#define SWAP_CLUSTER     8
+
+static struct vnode *swap_vnode;	/* NULL if no swap device */
+static unsigned swap_nslots;
+
+/* Slots in use, protected by swap_maplock */
+static struct spinlock swap_maplock = SPINLOCK_INITIALIZER;
+static struct bitmap *swap_map;
+static unsigned swap_nfree;
+static unsigned swap_cursor;		/* where to look for free slots */
+
+/*
+ * The VM lock, which serializes choosing victims. A semaphore, since
+ * locks are not implemented in the base kernel; swap_holder and
+ * swap_depth let the holder take it again.
+ */
+static struct semaphore *swap_mutex;
+static struct thread *volatile swap_holder;
+static unsigned swap_depth;
+
+/*
+ * Pageout thread. pageout_sem wakes it; pageout_wanted keeps the
+ * allocations that see memory low from waking it more than once.
+ */
+static struct semaphore *pageout_sem;
+static volatile bool pageout_wanted;
+static volatile unsigned pageout_lowater = SWAP_LOWATER;
+static volatile unsigned pageout_hiwater = SWAP_HIWATER;
+
+/* Statistics */
+static unsigned pageout_runs;		/* times the thread woke */
+static unsigned pageout_pages;		/* pages it evicted */
+static unsigned swap_syncevicts;	/* pages evicted by allocations */
+static unsigned swap_writes;		/* write requests */
+static unsigned swap_reads;		/* read requests */
+static unsigned swap_prefetched;	/* pages read ahead */
+
+static void swap_pageout(void *data1, unsigned long data2);
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	unsigned total, nfree;
+	int result;
+
+	swap_mutex = sem_create("swap", 1);
+	if (swap_mutex == NULL) {
+		panic("swap_bootstrap: could not create VM lock\n");
+	}
+
+	coremap_getstats(&total, &nfree);
+	if (pageout_hiwater > total / 2) {
+		/* tiny memory; don't keep most of it free */
+		pageout_hiwater = total / 2;
+		pageout_lowater = pageout_hiwater / 2;
+	}
+	pageout_sem = sem_create("pageout", 0);
+	if (pageout_sem == NULL) {
+		panic("swap_bootstrap: could not create pageout semaphore\n");
+	}
+	result = thread_fork("pageout", NULL, swap_pageout, NULL, 0);
+	if (result) {
+		panic("swap_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: no swap device %s (%s)\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result == 0) {
+		swap_nslots = st.st_size / PAGE_SIZE;
+		swap_map = bitmap_create(swap_nslots);
+	}
+	if (result || swap_nslots == 0 || swap_map == NULL) {
+		kprintf("swap: cannot use %s\n", SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+	swap_nfree = swap_nslots;
+
+	kprintf("swap: %uk in %u pages on %s\n",
+		swap_nslots * PAGE_SIZE / 1024, swap_nslots, SWAP_DEVICE);
+}
+
+void
+swap_lock(void)
+{
+	if (swap_holder == curthread) {
+		swap_depth++;
+		return;
+	}
+	P(swap_mutex);
+	KASSERT(swap_holder == NULL);
+	swap_holder = curthread;
+	swap_depth = 1;
+}
+
+void
+swap_unlock(void)
+{
+	KASSERT(swap_holder == curthread);
+	KASSERT(swap_depth > 0);
+	if (--swap_depth == 0) {
+		swap_holder = NULL;
+		V(swap_mutex);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slots
+
+/*
+ * Allocate N contiguous slots, searching onward from where the last
+ * allocation ended so that pages evicted one after another end up next
+ * to each other.
+ */
+static
+int
+swap_allocrun(unsigned n, unsigned *first)
+{
+	unsigned i, len, scanned, j;
+
+	KASSERT(n > 0);
+	spinlock_acquire(&swap_maplock);
+	if (swap_nfree < n) {
+		spinlock_release(&swap_maplock);
+		return ENOSPC;
+	}
+
+	len = 0;
+	i = swap_cursor;
+	for (scanned = 0; scanned < swap_nslots; scanned++, i++) {
+		if (i == swap_nslots) {
+			/* runs don't wrap around */
+			i = 0;
+			len = 0;
+		}
+		if (bitmap_isset(swap_map, i)) {
+			len = 0;
+			continue;
+		}
+		if (++len == n) {
+			*first = i + 1 - n;
+			for (j = *first; j <= i; j++) {
+				bitmap_mark(swap_map, j);
+			}
+			swap_nfree -= n;
+			swap_cursor = (i + 1) % swap_nslots;
+			spinlock_release(&swap_maplock);
+			return 0;
+		}
+	}
+	spinlock_release(&swap_maplock);
+	return ENOSPC;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+	spinlock_acquire(&swap_maplock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nfree++;
+	spinlock_release(&swap_maplock);
+}
+
+/*
+ * Transfer the N frames in PADDRS to or from N slots starting at SLOT,
+ * in one request to the device.
+ */
+static
+int
+swap_io(unsigned slot, const paddr_t *paddrs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	KASSERT(slot + n <= swap_nslots);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(paddrs[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, &paddr, 1, UIO_READ);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Eviction
+
+/*
+ * A page picked for eviction. v_slot is where it will be in swap, or
+ * COREMAP_NOSLOT if it will just be dropped; v_ok is cleared if it
+ * needed writing and that failed, in which case it stays.
+ */
+struct victim {
+	struct addrspace *v_as;
+	vaddr_t v_vaddr;
+	pte_t *v_pte;
+	paddr_t v_pa;
+	unsigned v_slot;
+	bool v_ok;
+};
+
+/*
+ * Run the clock until it stops on a page that has not been referenced
+ * since it last passed and that we can evict: one that is clean or
+ * already has a slot, or any if there are more than NEEDSLOTS free
+ * slots to write it to. Returns false if there is no such page. Call
+ * with the page table lock held, which keeps the owner from going
+ * away.
+ */
+static
+bool
+swap_victim(struct victim *v, unsigned needslots)
+{
+	unsigned total, nfree, n;
+
+	coremap_getstats(&total, &nfree);
+
+	/* Two passes: the first may only clear reference bits. */
+	for (n=0; n<2*total; n++) {
+		v->v_pa = coremap_clock(&v->v_as, &v->v_vaddr);
+		if (v->v_pa == 0) {
+			return false;
+		}
+		v->v_pte = pt_lookup(v->v_as->as_pt, v->v_vaddr, false);
+		KASSERT(v->v_pte != NULL);
+		KASSERT((*v->v_pte & PTE_FRAME) == v->v_pa);
+		if (*v->v_pte & PTE_BUSY) {
+			/* already picked, or being written back */
+			continue;
+		}
+		KASSERT(*v->v_pte & PTE_VALID);
+		if (*v->v_pte & PTE_REF) {
+			/* A stale entry just costs it its second chance. */
+			*v->v_pte &= ~PTE_REF;
+			vmtlb_invalidate_nowait(&v->v_as->as_asids,
+						v->v_vaddr);
+			continue;
+		}
+		v->v_slot = coremap_getslot(v->v_pa);
+		if ((*v->v_pte & PTE_DIRTY) && v->v_slot == COREMAP_NOSLOT &&
+		    swap_nfree <= needslots) {
+			continue;
+		}
+		v->v_ok = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Write out the N dirty victims in DIRTY. They all get new slots, in
+ * one run and one request if there is a run long enough; otherwise
+ * they go one at a time, each to its old slot if it has one.
+ */
+static
+void
+swap_writeout(struct victim **dirty, unsigned n)
+{
+	paddr_t pas[SWAP_CLUSTER];
+	unsigned first, slot, i;
+	bool newslot;
+
+	if (n == 0) {
+		return;
+	}
+
+	if (n > 1 && swap_allocrun(n, &first) == 0) {
+		for (i=0; i<n; i++) {
+			pas[i] = dirty[i]->v_pa;
+		}
+		if (swap_io(first, pas, n, UIO_WRITE) == 0) {
+			for (i=0; i<n; i++) {
+				if (dirty[i]->v_slot != COREMAP_NOSLOT) {
+					swap_free(dirty[i]->v_slot);
+				}
+				dirty[i]->v_slot = first + i;
+				vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+			}
+			swap_writes++;
+			return;
+		}
+		for (i=0; i<n; i++) {
+			swap_free(first + i);
+		}
+		/* try them one at a time */
+	}
+
+	for (i=0; i<n; i++) {
+		slot = dirty[i]->v_slot;
+		newslot = false;
+		if (slot == COREMAP_NOSLOT) {
+			if (swap_allocrun(1, &slot)) {
+				dirty[i]->v_ok = false;
+				continue;
+			}
+			newslot = true;
+		}
+		if (swap_io(slot, &dirty[i]->v_pa, 1, UIO_WRITE)) {
+			if (newslot) {
+				swap_free(slot);
+			}
+			dirty[i]->v_ok = false;
+			continue;
+		}
+		dirty[i]->v_slot = slot;
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+		swap_writes++;
+	}
+}
+
+/*
+ * Order victims by address space and then address, so that pages
+ * next to each other in memory go next to each other in swap and
+ * swap_pagein can read them back together.
+ */
+static
+void
+swap_sortvictims(struct victim **v, unsigned n)
+{
+	struct victim *t;
+	unsigned i, j;
+
+	for (i=1; i<n; i++) {
+		t = v[i];
+		for (j=i; j>0; j--) {
+			if (v[j-1]->v_as < t->v_as ||
+			    (v[j-1]->v_as == t->v_as &&
+			     v[j-1]->v_vaddr < t->v_vaddr)) {
+				break;
+			}
+			v[j] = v[j-1];
+		}
+		v[j] = t;
+	}
+}
+
+/*
+ * Evict up to MAX pages (at most SWAP_CLUSTER), writing the dirty ones
+ * to swap together. Reports how many went in *NEVICTED; fails if none
+ * did. Call with the VM lock held; it is dropped during the write.
+ */
+static
+int
+swap_evict(unsigned max, unsigned *nevicted)
+{
+	struct victim v[SWAP_CLUSTER], *dirty[SWAP_CLUSTER];
+	unsigned n, ndirty, needslots, i;
+
+	KASSERT(swap_holder == curthread);
+
+	if (max > SWAP_CLUSTER) {
+		max = SWAP_CLUSTER;
+	}
+
+	/*
+	 * Stop the owners from using the victims while they are copied
+	 * out: with PTE_VALID clear and PTE_BUSY set, the next access
+	 * to one waits in vm_fault for us to finish, and leaves the
+	 * owner alive until then.
+	 */
+	pt_lock();
+	n = ndirty = needslots = 0;
+	while (n < max && swap_victim(&v[n], needslots)) {
+		*v[n].v_pte = (*v[n].v_pte & ~PTE_VALID) | PTE_BUSY;
+		if (*v[n].v_pte & PTE_DIRTY) {
+			if (v[n].v_slot == COREMAP_NOSLOT) {
+				needslots++;
+			}
+			dirty[ndirty++] = &v[n];
+		}
+		n++;
+	}
+	pt_unlock();
+	if (n == 0) {
+		return ENOMEM;
+	}
+
+	/* Once no TLB has them, nothing can still be writing them. */
+	for (i=0; i<n; i++) {
+		vmtlb_invalidate(&v[i].v_as->as_asids, v[i].v_vaddr);
+	}
+
+	if (ndirty > 0) {
+		/* Let faults and other evictions go on meanwhile. */
+		swap_sortvictims(dirty, ndirty);
+		swap_unlock();
+		swap_writeout(dirty, ndirty);
+		swap_lock();
+	}
+
+	*nevicted = 0;
+	pt_lock();
+	for (i=0; i<n; i++) {
+		if (!v[i].v_ok) {
+			/* still resident; it will just fault back in */
+			*v[i].v_pte = (*v[i].v_pte | PTE_VALID) & ~PTE_BUSY;
+			continue;
+		}
+		*v[i].v_pte = (v[i].v_slot == COREMAP_NOSLOT) ? 0 :
+			PTE_MKSWAPPED(v[i].v_slot);
+		coremap_setowner(v[i].v_pa, NULL, 0);
+		coremap_setslot(v[i].v_pa, COREMAP_NOSLOT);
+		coremap_free(v[i].v_pa);
+		(*nevicted)++;
+	}
+	pt_wakebusy();
+	pt_unlock();
+	return (*nevicted > 0) ? 0 : EIO;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pageout
+
+/*
+ * The pageout thread. Evicts a cluster at a time, so faults can get
+ * the VM lock in between.
+ */
+static
+void
+swap_pageout(void *data1, unsigned long data2)
+{
+	unsigned total, nfree, n;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		P(pageout_sem);
+		pageout_runs++;
+		do {
+			swap_lock();
+			coremap_getstats(&total, &nfree);
+			if (nfree >= pageout_hiwater) {
+				result = -1;
+			}
+			else {
+				result = swap_evict(pageout_hiwater - nfree,
+						    &n);
+				if (result == 0) {
+					pageout_pages += n;
+				}
+			}
+			swap_unlock();
+		} while (result == 0);
+		pageout_wanted = false;
+	}
+}
+
+/*
+ * Wake the pageout thread if free memory is below the low watermark.
+ * Only V, so this is safe wherever allocating is.
+ */
+static
+void
+swap_checkwater(void)
+{
+	unsigned total, nfree;
+
+	if (pageout_sem == NULL) {
+		/* swap_bootstrap hasn't got that far */
+		return;
+	}
+	coremap_getstats(&total, &nfree);
+	if (nfree < pageout_lowater && !pageout_wanted) {
+		pageout_wanted = true;
+		V(pageout_sem);
+	}
+}
+
+paddr_t
+swap_getpages(unsigned long npages)
+{
+	unsigned long tries;
+	unsigned n;
+	paddr_t pa;
+
+	pa = coremap_alloc(npages);
+	if (swap_mutex == NULL) {
+		/* still booting */
+		return pa;
+	}
+	swap_checkwater();
+	if (pa != 0) {
+		return pa;
+	}
+	if (curthread->t_in_interrupt || curthread->t_iplhigh_count != 0) {
+		/*
+		 * Can't sleep, so can't take the VM lock. A spinlock
+		 * holder only shows in t_iplhigh_count, not t_curspl.
+		 */
+		return 0;
+	}
+
+	/* The reserve ran out; evict right here. */
+	swap_lock();
+	for (tries = 0; pa == 0 && tries < npages * SWAP_EVICTTRIES;
+	     tries += n) {
+		if (swap_evict(SWAP_CLUSTER, &n)) {
+			break;
+		}
+		swap_syncevicts += n;
+		pa = coremap_alloc(npages);
+	}
+	swap_unlock();
+	return pa;
+}
+
+/*
+ * Whether there is memory to spare for reading ahead: prefetching
+ * never evicts, and doesn't dig into the pageout reserve.
+ */
+static
+bool
+swap_canprefetch(void)
+{
+	unsigned total, nfree;
+
+	coremap_getstats(&total, &nfree);
+	return nfree > pageout_lowater;
+}
+
+int
+swap_pagein(struct addrspace *as, vaddr_t vaddr, unsigned slot, pte_t *newpte)
+{
+	paddr_t pas[SWAP_CLUSTER];
+	pte_t *ptes[SWAP_CLUSTER];
+	unsigned n, i;
+	vaddr_t va;
+	int result;
+
+	pas[0] = swap_getpages(1);
+	if (pas[0] == 0) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Read ahead the following pages, as long as they went out
+	 * with this one and so are in the following slots. They are
+	 * busy like this one until they are in.
+	 */
+	pt_lock();
+	for (n=1; n<SWAP_CLUSTER; n++) {
+		va = vaddr + n * PAGE_SIZE;
+		if (va >= USERSPACETOP || slot + n >= swap_nslots) {
+			break;
+		}
+		ptes[n] = pt_lookup(as->as_pt, va, false);
+		if (ptes[n] == NULL || *ptes[n] != PTE_MKSWAPPED(slot + n) ||
+		    !swap_canprefetch()) {
+			break;
+		}
+		pas[n] = coremap_alloc(1);
+		if (pas[n] == 0) {
+			break;
+		}
+		*ptes[n] |= PTE_BUSY;
+	}
+	pt_unlock();
+
+	result = swap_io(slot, pas, n, UIO_READ);
+
+	pt_lock();
+	for (i=1; i<n; i++) {
+		if (result) {
+			*ptes[i] &= ~PTE_BUSY;
+			continue;
+		}
+		/* Clean, so the slot stays with it in case it goes out again. */
+		*ptes[i] = pas[i] | PTE_VALID;
+		coremap_setslot(pas[i], slot + i);
+		coremap_setowner(pas[i], as, vaddr + i * PAGE_SIZE);
+	}
+	pt_wakebusy();
+	pt_unlock();
+
+	if (result) {
+		for (i=0; i<n; i++) {
+			coremap_free(pas[i]);
+		}
+		return result;
+	}
+
+	*newpte = pas[0] | PTE_VALID;
+	coremap_setslot(pas[0], slot);
+	swap_reads++;
+	swap_prefetched += n - 1;
+
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	return 0;
+}
+
+void
+swap_freeframe(paddr_t paddr)
+{
+	unsigned slot;
+
+	if (coremap_refcount(paddr) == 1) {
+		slot = coremap_getslot(paddr);
+		if (slot != COREMAP_NOSLOT) {
+			swap_free(slot);
+		}
+	}
+	coremap_free(paddr);
+}
+
+int
+swap_setwater(unsigned low, unsigned high)
+{
+	unsigned total, nfree;
+
+	coremap_getstats(&total, &nfree);
+	if (low >= high || high > total) {
+		return EINVAL;
+	}
+	pageout_lowater = low;
+	pageout_hiwater = high;
+	return 0;
+}
+
+void
+swap_getwater(unsigned *low, unsigned *high)
+{
+	*low = pageout_lowater;
+	*high = pageout_hiwater;
+}
+
+void
+swap_printstats(void)
+{
+	if (swap_vnode == NULL) {
+		kprintf("Swap: none\n");
+	}
+	else {
+		kprintf("Swap: %u of %u pages in use on %s\n",
+			swap_nslots - swap_nfree, swap_nslots, SWAP_DEVICE);
+	}
+	kprintf("Pageout: watermarks %u/%u pages, woken %u times, "
+		"%u pages evicted ahead, %u in allocations\n",
+		pageout_lowater, pageout_hiwater, pageout_runs,
+		pageout_pages, swap_syncevicts);
+	kprintf("Swap I/O: %u write requests, %u read requests, "
+		"%u pages read ahead\n", swap_writes, swap_reads,
+		swap_prefetched);
+}
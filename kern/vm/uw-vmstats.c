@@ -33,6 +33,9 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Zeroed Pool Hits",
+ /* 11 */ "Zeroed Pool Misses",
+ /* 12 */ "TLB Faults Avoided",
 };
 
 
@@ -102,6 +105,7 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int zero_allocs = 0;
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -133,5 +137,11 @@ vmstats_print(void)
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  zero_allocs = stats_counts[VMSTAT_ZERO_POOL_HIT] + stats_counts[VMSTAT_ZERO_POOL_MISS];
+  if (zero_allocs > 0) {
+    kprintf("VMSTAT Zeroed Pool hit rate = %d%%\n",
+      stats_counts[VMSTAT_ZERO_POOL_HIT] * 100 / zero_allocs);
+  }
 }
 /* ---------------------------------------------------------------------- */
@@ -0,0 +1,527 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <proc.h>
+#include <current.h>
+#include <machine/tlb.h>
+#include <machine/vmtlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
+
+/*
+ * Paged virtual memory.
+ *
+ * User pages are allocated and zero-filled in vm_fault the first time
+ * they are touched (and, in regions that map part of an executable,
+ * read in from it), and recorded in the address space's page table;
+ * later TLB misses on them just reload the TLB from the page table.
+ * Pages start out read-only; the first write to one marks it dirty
+ * and makes it writable, and if it is shared copy-on-write (see
+ * addrspace.c), copies it first. When memory runs out, pages are
+ * evicted to swap (see swap.h) and brought back here.
+ *
+ * A read from a page that would just be zero-filled maps the shared
+ * zero page instead, read-only and with a reference on it, so that
+ * the first write copies it like any other shared page. Memory that
+ * is only ever read then costs nothing.
+ *
+ * Fault-around: after a fault, resident pages next to the faulting one
+ * in the same region are loaded into the TLB too, so that a program
+ * walking through memory doesn't fault on each of them. The window
+ * starts at VM_FAMIN pages on either side; each fault that continues
+ * a walk in the same direction (landing just past what was preloaded
+ * last time) doubles it in that direction, up to VM_FAMAX, and any
+ * other fault shrinks it back. Each page preloaded counts as a TLB
+ * fault avoided, which it is if used before being replaced.
+ *
+ * Page tables are only looked at holding the page table lock (see
+ * pagetable.h), so reloading the TLB for a resident page never
+ * sleeps. Paging in or copying a page marks it busy and drops the
+ * lock while it sleeps; a fault that finds its page busy waits, and
+ * any fault looks at the PTE again after sleeping.
+ */
+
+/* The shared zero page; always has a reference of its own. */
+static paddr_t vm_zeropage;
+
+/* Fault-around window, in pages */
+#define VM_FAMIN  1
+#define VM_FAMAX  16
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	pt_bootstrap();
+	vmstats_init();
+
+	vm_zeropage = coremap_alloc(1);
+	if (vm_zeropage == 0) {
+		panic("vm_bootstrap: no memory for the zero page\n");
+	}
+	bzero((void *)PADDR_TO_KVADDR(vm_zeropage), PAGE_SIZE);
+
+	swap_bootstrap();
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = swap_getpages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+/*
+ * Idle cpus keep the coremap's pool of zeroed pages full.
+ */
+bool
+vm_idle(void)
+{
+	return coremap_zerofill();
+}
+
+/*
+ * Get a zeroed page, from the pool if it has one.
+ */
+static
+paddr_t
+vm_getzeroed(void)
+{
+	paddr_t paddr;
+
+	paddr = coremap_allocz();
+	if (paddr != 0) {
+		vmstats_inc(VMSTAT_ZERO_POOL_HIT);
+		return paddr;
+	}
+	vmstats_inc(VMSTAT_ZERO_POOL_MISS);
+
+	paddr = swap_getpages(1);
+	if (paddr != 0) {
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	}
+	return paddr;
+}
+
+/*
+ * Shootdowns sent by vmtlb_invalidate (see vmtlb.h). Too many at once
+ * just flush the TLB.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	vmtlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vmtlb_shootdown(ts);
+}
+
+/*
+ * Find the part [*START, *END) of the page at VADDR in region RG that
+ * comes from its file. Returns false if none does.
+ */
+static
+bool
+vm_filerange(struct region *rg, vaddr_t vaddr, vaddr_t *start, vaddr_t *end)
+{
+	if (rg->rg_backing == RGB_ANON) {
+		return false;
+	}
+	*start = vaddr;
+	if (*start < rg->rg_fvaddr) {
+		*start = rg->rg_fvaddr;
+	}
+	*end = vaddr + PAGE_SIZE;
+	if (*end > rg->rg_fvaddr + rg->rg_filesz) {
+		*end = rg->rg_fvaddr + rg->rg_filesz;
+	}
+	return *start < *end;
+}
+
+/*
+ * Read the part of the page at VADDR in file-backed region RG that
+ * comes from the file into the zeroed frame PADDR. Sets *DIDREAD if
+ * any of it does.
+ */
+static
+int
+vm_readfile(struct region *rg, vaddr_t vaddr, paddr_t paddr, bool *didread)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	if (!vm_filerange(rg, vaddr, &start, &end)) {
+		/* all bss */
+		*didread = false;
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + start - vaddr),
+		  end - start, rg->rg_foffset + (start - rg->rg_fvaddr),
+		  UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	*didread = true;
+	return 0;
+}
+
+/*
+ * Allocate a page for a fault of type FAULTTYPE at VADDR in region RG
+ * of AS, fill it, and hand back its PTE in *NEWPTE. A read of a page
+ * with nothing from the file in it gets the zero page. Called with
+ * the page busy and without the page table lock, since reading the
+ * file sleeps.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	  int faulttype, pte_t *newpte)
+{
+	paddr_t paddr;
+	vaddr_t start, end;
+	bool didread = false;
+	int result;
+
+	/* Not while loading, since the loader's TLB entries are writable. */
+	if (faulttype == VM_FAULT_READ && !as->as_loading &&
+	    !vm_filerange(rg, vaddr, &start, &end)) {
+		coremap_ref(vm_zeropage);
+		*newpte = vm_zeropage | PTE_VALID;
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	paddr = vm_getzeroed();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	if (rg->rg_backing != RGB_ANON) {
+		result = vm_readfile(rg, vaddr, paddr, &didread);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+	}
+
+	*newpte = paddr | PTE_VALID;
+	if (didread) {
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+	else {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+	return 0;
+}
+
+/*
+ * Bring in the page of AS at VADDR in region RG, whose PTE *PTE is not
+ * resident. Called with the page table lock held; drops it while the
+ * page is filled, so the caller must look at *PTE again afterwards.
+ * Also used by as_copy for shared mappings.
+ */
+int
+vm_getpage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	   int faulttype, pte_t *pte)
+{
+	pte_t oldpte, newpte;
+	int result;
+
+	oldpte = *pte;
+	*pte = oldpte | PTE_BUSY;
+	pt_unlock();
+
+	if (oldpte & PTE_SWAPPED) {
+		result = swap_pagein(as, vaddr, PTE_SLOT(oldpte), &newpte);
+	}
+	else {
+		result = vm_pagein(as, rg, vaddr, faulttype, &newpte);
+	}
+
+	pt_lock();
+	*pte = result ? oldpte : newpte;
+	pt_wakebusy();
+	return result;
+}
+
+/*
+ * Give AS a private copy of the shared page at VADDR, whose PTE is
+ * *PTE, and make it dirty and writable. Called with the page table
+ * lock held; drops it while copying, so the caller must look at *PTE
+ * again afterwards.
+ */
+static
+int
+vm_copypage(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	pte_t oldpte;
+	paddr_t oldpa, newpa;
+
+	oldpte = *pte;
+	oldpa = oldpte & PTE_FRAME;
+	*pte = oldpte | PTE_BUSY;
+	pt_unlock();
+
+	/* Our reference keeps the old frame from going away. */
+	if (oldpa == vm_zeropage) {
+		newpa = vm_getzeroed();
+	}
+	else {
+		newpa = swap_getpages(1);
+		if (newpa != 0) {
+			memmove((void *)PADDR_TO_KVADDR(newpa),
+				(const void *)PADDR_TO_KVADDR(oldpa),
+				PAGE_SIZE);
+		}
+	}
+
+	pt_lock();
+	if (newpa == 0) {
+		*pte = oldpte;
+		pt_wakebusy();
+		return ENOMEM;
+	}
+	*pte = newpa | (oldpte & ~PTE_FRAME) | PTE_WRITE | PTE_DIRTY;
+	pt_wakebusy();
+	pt_unlock();
+
+	/*
+	 * Other cpus may still map the old frame for us, and once the
+	 * last sharer has it to itself it may write it.
+	 */
+	vmtlb_invalidate(&as->as_asids, vaddr);
+
+	pt_lock();
+	/* drops our reference; any others keep the swap copy */
+	swap_freeframe(oldpa);
+	return 0;
+}
+
+/*
+ * Work out the new fault-around window for a fault at VADDR in AS,
+ * and preload the resident pages in it that are within region RG.
+ * Call with the page table lock held.
+ */
+static
+void
+vm_faultaround(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	vaddr_t last, top, va;
+	int win, reach, lo, hi, i;
+	pte_t *pte;
+
+	/* How far the last fault preloaded, in the walk's direction */
+	last = as->as_falast;
+	win = as->as_fawindow;
+	reach = (win == 0 ? VM_FAMIN : (win < 0 ? -win : win)) + 1;
+
+	if (win >= 0 && vaddr > last && vaddr <= last + reach * PAGE_SIZE) {
+		win = win == 0 ? VM_FAMIN * 2 : win * 2;
+		win = win > VM_FAMAX ? VM_FAMAX : win;
+		lo = 1;
+		hi = win;
+	}
+	else if (win <= 0 && vaddr < last &&
+		 vaddr >= last - reach * PAGE_SIZE) {
+		win = win == 0 ? -VM_FAMIN * 2 : win * 2;
+		win = win < -VM_FAMAX ? -VM_FAMAX : win;
+		lo = win;
+		hi = -1;
+	}
+	else {
+		/* Not a walk (yet): a little on either side. */
+		win = 0;
+		lo = -VM_FAMIN;
+		hi = VM_FAMIN;
+	}
+	as->as_falast = vaddr;
+	as->as_fawindow = win;
+
+	top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	for (i = lo; i <= hi; i++) {
+		va = vaddr + i * PAGE_SIZE;
+		if (i == 0 || va < rg->rg_vbase || va >= top) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || (*pte & PTE_VALID) == 0) {
+			continue;
+		}
+		if (vmtlb_preload(va, *pte & (PTE_FRAME|PTE_VALID|PTE_WRITE))) {
+			*pte |= PTE_REF;
+			vmstats_inc(VMSTAT_FAULT_AROUND);
+		}
+	}
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	paddr_t paddr;
+	uint32_t elo;
+	bool pagedin;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		rg = as_growstack(as, faultaddress);
+		if (rg == NULL) {
+			return EFAULT;
+		}
+	}
+	if (faulttype != VM_FAULT_READ && (rg->rg_perms & RG_WRITE) == 0 &&
+	    !as->as_loading) {
+		/* A write to a page of a read-only region */
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	/* Make the leaf, if need be, before taking the lock. */
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	pt_lock();
+	pagedin = false;
+	while (1) {
+		if (*pte & PTE_BUSY) {
+			/* Being paged in or out; wait and look again. */
+			pt_waitbusy();
+			continue;
+		}
+		if ((*pte & PTE_VALID) == 0) {
+			result = vm_getpage(as, rg, faultaddress, faulttype,
+					    pte);
+			if (result) {
+				goto out;
+			}
+			pagedin = true;
+			continue;
+		}
+		if (faulttype != VM_FAULT_READ && (*pte & PTE_WRITE) == 0 &&
+		    (rg->rg_perms & RG_WRITE)) {
+			/*
+			 * Others sharing the frame get their own copy,
+			 * unless it is in a shared mapping, where they
+			 * are meant to see the write.
+			 */
+			paddr = *pte & PTE_FRAME;
+			if (coremap_refcount(paddr) > 1 &&
+			    (rg->rg_backing != RGB_SHARED ||
+			     paddr == vm_zeropage)) {
+				result = vm_copypage(as, faultaddress, pte);
+				if (result) {
+					goto out;
+				}
+				continue;
+			}
+			*pte |= PTE_WRITE | PTE_DIRTY;
+		}
+		break;
+	}
+	if (!pagedin && faulttype != VM_FAULT_READONLY) {
+		/* Page is resident; it just fell out of the TLB. */
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+
+	elo = *pte & (PTE_FRAME | PTE_VALID | PTE_WRITE);
+	if (as->as_loading) {
+		/* load_elf writes even the read-only segments */
+		elo |= TLBLO_DIRTY;
+		*pte |= PTE_DIRTY;
+	}
+
+	/*
+	 * Mark it referenced for the clock, and if it is no longer
+	 * shared, take it back as ours so it can be evicted again.
+	 */
+	*pte |= PTE_REF;
+	paddr = *pte & PTE_FRAME;
+	if (coremap_refcount(paddr) == 1) {
+		coremap_setowner(paddr, as, faultaddress);
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, elo & PTE_FRAME);
+
+	/* The lock keeps interrupts off while we frob the TLB. */
+	vmtlb_load(faultaddress, elo);
+	if (!as->as_loading) {
+		/* The loader's entries must all be writable; skip it. */
+		vm_faultaround(as, rg, faultaddress);
+	}
+
+	result = 0;
+ out:
+	pt_unlock();
+	return result;
+}